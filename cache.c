@@ -0,0 +1,344 @@
+/*-
+ * Copyright (c) 2015 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#include "types.h"
+#include "cache.h"
+#include "config.h"
+
+/*
+ * Simple persistent caches. A cache is a file in the user's home
+ * directory with one "key value" pair per line. Keys must not contain
+ * whitespace, and values must not contain newlines.
+ */
+
+static bool
+match_key(const char *ln, const char *key, size_t keylen)
+{
+	return (strncmp(ln, key, keylen) == 0 && ln[keylen] == ' ' ?
+	    true : false);
+}
+
+/*
+ * Looks up 'key' in the given cache file.
+ *
+ * Returns a copy of the value, or NULL if the key wasn't found.
+ */
+char *
+cache_get(const char *file, const char *key)
+{
+	FILE	*fp;
+	char	*path, *ln, *val;
+	size_t	keylen, lnsz;
+	ssize_t len;
+
+	if ((path = homepath(file)) == NULL)
+		return (NULL);
+	fp = fopen(path, "r"); free(path);
+	if (fp == NULL)
+		return (NULL);
+	keylen = strlen(key); ln = val = NULL; lnsz = 0;
+	while (val == NULL && (len = getline(&ln, &lnsz, fp)) > 0) {
+		if (ln[len - 1] == '\n')
+			ln[len - 1] = '\0';
+		if (match_key(ln, key, keylen))
+			val = strdup(ln + keylen + 1);
+	}
+	free(ln); (void)fclose(fp);
+
+	return (val);
+}
+
+/*
+ * Sets the value of 'key' in the given cache file, or removes the key if
+ * 'val' is NULL. The file is replaced atomically, so concurrent readers
+ * always see a consistent cache.
+ */
+int
+cache_put(const char *file, const char *key, const char *val)
+{
+	int	fd;
+	FILE	*fp, *tmpfp;
+	char	*path, *tmpl, *ln;
+	size_t	keylen, lnsz;
+	ssize_t len;
+
+	if ((path = homepath(file)) == NULL)
+		return (-1);
+	if ((tmpl = malloc(strlen(path) + 8)) == NULL) {
+		warn("malloc()"); free(path); return (-1);
+	}
+	(void)sprintf(tmpl, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmpl)) == -1) {
+		free(path); free(tmpl); return (-1);
+	}
+	if ((tmpfp = fdopen(fd, "w")) == NULL) {
+		(void)close(fd); (void)remove(tmpl);
+		free(path); free(tmpl); return (-1);
+	}
+	keylen = strlen(key);
+	if ((fp = fopen(path, "r")) != NULL) {
+		for (ln = NULL, lnsz = 0; (len = getline(&ln, &lnsz, fp)) > 0;) {
+			if (!match_key(ln, key, keylen) && ln[len - 1] == '\n')
+				(void)fputs(ln, tmpfp);
+		}
+		free(ln); (void)fclose(fp);
+	}
+	if (val != NULL)
+		(void)fprintf(tmpfp, "%s %s\n", key, val);
+	if (fclose(tmpfp) != 0 || rename(tmpl, path) == -1) {
+		(void)remove(tmpl); free(path); free(tmpl);
+		return (-1);
+	}
+	free(path); free(tmpl);
+
+	return (0);
+}
+
+/*
+ * The document cache is a directory with one file per entry. The file
+ * name is a hash of the entry's key. A file starts with a "Key <length>"
+ * line, followed by the key itself and a newline, so that an entry whose
+ * name collides with another key's is never taken for it. The validators
+ * of the document follow, one "name value" pair per line, then an empty
+ * line and the document. Entries are mapped into memory, and the
+ * modification time of the file is the time the document was last
+ * validated.
+ */
+
+/*
+ * Returns the path of the cache file for 'key'. If 'create' is true, the
+ * cache directory is created if it doesn't exist.
+ */
+static char *
+entry_path(const char *key, bool create)
+{
+	int	   i;
+	char	   *dir, *path, *p;
+	uint64_t   h[2];
+	const char *k;
+
+	/* Two FNV-1a hashes with different offset bases. */
+	h[0] = 0xcbf29ce484222325ULL; h[1] = 0x84222325cbf29ce4ULL;
+	for (k = key; *k != '\0'; k++) {
+		for (i = 0; i < 2; i++) {
+			h[i] ^= (u_char)*k;
+			h[i] *= 0x100000001b3ULL;
+		}
+	}
+	if ((dir = homepath(PATH_CACHEDIR)) == NULL)
+		return (NULL);
+	if (create) {
+		/* Create the parent first. */
+		if ((p = strrchr(dir, '/')) != NULL) {
+			*p = '\0';
+			(void)mkdir(dir, S_IRWXU);
+			*p = '/';
+		}
+		if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST) {
+			warn("mkdir(%s)", dir); free(dir); return (NULL);
+		}
+	}
+	if ((path = malloc(strlen(dir) + 34)) == NULL) {
+		warn("malloc()"); free(dir); return (NULL);
+	}
+	(void)sprintf(path, "%s/%016llx%016llx", dir, (unsigned long long)h[0],
+	    (unsigned long long)h[1]);
+	free(dir);
+
+	return (path);
+}
+
+void
+cache_entry_free(cache_entry_t *ce)
+{
+	if (ce == NULL)
+		return;
+	if (ce->mapsz > 0)
+		(void)munmap(ce->buf, ce->mapsz);
+	else
+		free(ce->buf);
+	free(ce);
+}
+
+/*
+ * Checks whether the entry in 'buf' of size 'size' starts with 'key'.
+ *
+ * Returns a pointer to the first byte after the key, or NULL.
+ */
+static char *
+match_entry_key(char *buf, size_t size, const char *key)
+{
+	char   *p, *nl;
+	size_t keylen;
+
+	keylen = strlen(key);
+	if ((nl = memchr(buf, '\n', size)) == NULL)
+		return (NULL);
+	*nl = '\0';
+	if (strncmp(buf, "Key ", 4) != 0 ||
+	    strtoull(buf + 4, &p, 10) != keylen || *p != '\0')
+		return (NULL);
+	p = nl + 1;
+	if ((size_t)(buf + size - p) <= keylen ||
+	    memcmp(p, key, keylen) != 0 || p[keylen] != '\n')
+		return (NULL);
+	return (p + keylen + 1);
+}
+
+/*
+ * Looks up the document cached for 'key'.
+ *
+ * Returns the cache entry, or NULL if there is none.
+ */
+cache_entry_t *
+cache_entry_get(const char *key)
+{
+	int	      fd;
+	char	      *path, *p, *nl, *val, *end;
+	void	      *buf;
+	struct stat   sb;
+	cache_entry_t *ce;
+
+	if ((path = entry_path(key, false)) == NULL)
+		return (NULL);
+	fd = open(path, O_RDONLY); free(path);
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		(void)close(fd); return (NULL);
+	}
+	/* A private, writable mapping lets us terminate the fields. */
+	buf = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+	    0);
+	(void)close(fd);
+	if (buf == MAP_FAILED)
+		return (NULL);
+	if ((ce = malloc(sizeof(*ce))) == NULL) {
+		warn("malloc()"); (void)munmap(buf, sb.st_size);
+		return (NULL);
+	}
+	(void)memset(ce, 0, sizeof(*ce));
+	ce->buf	  = buf;
+	ce->mapsz = sb.st_size;
+	ce->mtime = sb.st_mtime;
+
+	if ((p = match_entry_key(ce->buf, ce->mapsz, key)) == NULL) {
+		/* Old format, or the hash of another key */
+		cache_entry_free(ce); return (NULL);
+	}
+	end = ce->buf + ce->mapsz;
+	for (; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+		*nl = '\0';
+		if (nl == p)
+			break;
+		if ((val = strchr(p, ' ')) == NULL)
+			continue;
+		*val++ = '\0';
+		if (strcmp(p, "ETag") == 0)
+			ce->etag = val;
+		else if (strcmp(p, "Last-Modified") == 0)
+			ce->lastmod = val;
+	}
+	if (nl == NULL) {
+		/* Truncated entry */
+		cache_entry_free(ce); return (NULL);
+	}
+	ce->data = nl + 1;
+	ce->len  = end - ce->data;
+
+	return (ce);
+}
+
+/*
+ * Marks the document cached for 'key' as validated now.
+ */
+void
+cache_entry_touch(const char *key)
+{
+	char *path;
+
+	if ((path = entry_path(key, false)) == NULL)
+		return;
+	(void)utimes(path, NULL);
+	free(path);
+}
+
+/*
+ * Stores the document 'data' of length 'len' and its validators under
+ * 'key'. The file is replaced atomically.
+ */
+int
+cache_entry_put(const char *key, const char *etag, const char *lastmod,
+		const char *data, size_t len)
+{
+	int  fd, error;
+	FILE *fp;
+	char *path, *tmpl;
+
+	if ((path = entry_path(key, true)) == NULL)
+		return (-1);
+	if ((tmpl = malloc(strlen(path) + 8)) == NULL) {
+		warn("malloc()"); free(path); return (-1);
+	}
+	(void)sprintf(tmpl, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmpl)) == -1) {
+		free(path); free(tmpl); return (-1);
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		(void)close(fd); (void)remove(tmpl);
+		free(path); free(tmpl); return (-1);
+	}
+	(void)fprintf(fp, "Key %zu\n%s\n", strlen(key), key);
+	if (etag != NULL)
+		(void)fprintf(fp, "ETag %s\n", etag);
+	if (lastmod != NULL)
+		(void)fprintf(fp, "Last-Modified %s\n", lastmod);
+	(void)fputc('\n', fp);
+	(void)fwrite(data, 1, len, fp);
+	error = ferror(fp);
+	if (fclose(fp) != 0 || error || rename(tmpl, path) == -1) {
+		(void)remove(tmpl); free(path); free(tmpl);
+		return (-1);
+	}
+	free(path); free(tmpl);
+
+	return (0);
+}
@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2015 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CACHE_H_
+# define _CACHE_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#define PATH_CACHEDIR	".cache/cliaspora"
+
+/*
+ * An entry of the document cache. 'etag', 'lastmod' and 'data' point
+ * into 'buf', which is either the mapped cache file, or malloc()ed.
+ */
+typedef struct cache_entry_s {
+	char   *buf;
+	char   *etag;		/* Validators of the document, or NULL */
+	char   *lastmod;
+	char   *data;		/* The document */
+	size_t len;
+	size_t mapsz;		/* Size of the mapping, or 0 */
+	time_t mtime;		/* Time the document was last validated */
+} cache_entry_t;
+
+extern int  cache_put(const char *, const char *, const char *);
+extern int  cache_entry_put(const char *, const char *, const char *,
+			    const char *, size_t);
+extern void cache_entry_touch(const char *);
+extern char *cache_get(const char *, const char *);
+extern void cache_entry_free(cache_entry_t *);
+extern cache_entry_t *cache_entry_get(const char *);
+#endif	/* !_CACHE_H_ */
@@ -41,12 +41,15 @@
 #include "json.h"
 #include "ssl.h"
 #include "http.h"
+#include "dns.h"
 #include "config.h"
 #include "file.h"
 #include "str.h"
 #include "str.h"
 
 #define USER_AGENT "Cliaspora"
+#define DEADLINE_GRACE 2	/* Seconds to wind down after the deadline. */
+#define LOGIN_RETRIES  6	/* Max. retries until the pod sets the cookie. */
 
 typedef struct aspect_s {
 	int  id;
@@ -87,6 +90,7 @@ typedef struct session_s {
 	char	    *host;	/* Pod address. */
 	char	    *cookie;	/* Session cookie. */
 	u_short	    port;	/* Pod port. */
+	http_pool_t *pool;	/* Idle connections to the pod. */
 	msg_idx_t   *midx;	/* TOC of your private messages.*/
 	contact_t   *contacts;	/* List of your contacts. */
 	user_attr_t attr;
@@ -118,7 +122,7 @@ typedef struct post_s {
 } post_t;
 
 static int	 upload(session_t *, const char *, const char *, char * const *);
-static int	 upload_file(session_t *, const char *);
+static int	 photo_id(http_job_t *);
 static int	 close_session(session_t *);
 static int	 read_stream(session_t *, const char *);
 static int	 get_aspect_id(session_t *, const char *);
@@ -127,8 +131,10 @@ static int	 get_pm_id(session_t *, const char *);
 static int	 dpoll(session_t *, const char *, const char *, const char *,
 		       const char *);
 static int	 post(session_t *, const char *, const char *);
-static int	 like(session_t *, int);
-static int	 delete_post(session_t *, int);
+static int	 like(session_t *, char * const *);
+static int	 delete_post(session_t *, char * const *);
+static int	 post_batch(session_t *, char * const *, int, const char *,
+			    int);
 static int	 comment(session_t *, const char *, int);
 static int	 message(session_t *, const char *, const char *, int);
 static int	 reply(session_t *, const char *, int);
@@ -137,10 +143,10 @@ static int	 add_aspect(session_t *, const char *, bool);
 static int	 add_contact(session_t *, int, int);
 static int	 follow_tag(session_t *, const char *);
 static int	 get_attributs(session_t *);
+static char	 *photo_url(const char *);
 extern char	 *readpass(void);
 static char	 *get_post_guid(session_t *, int);
-static char	 *diaspora_login(const char *, u_short, const char *,
-				 const char *);
+static char	 *diaspora_login(session_t *, const char *, const char *);
 static void	 groff_printf(const char *, ...);
 static void	 show_msg_index(session_t *);
 static void	 show_aspects(session_t *);
@@ -150,6 +156,7 @@ static void	 free_msg_idx(msg_idx_t *);
 static void	 usage(void);
 static void	 free_contacts(contact_t *);
 static void	 cleanup(int);
+static void	 deadline_exceeded(int);
 static aspect_t  *get_aspects(json_node_t *);
 static session_t *create_session(void);
 static session_t *new_session(const char *, u_short, const char *,
@@ -161,10 +168,22 @@ static contact_t *new_contact_node(contact_t *);
 static contact_t *get_contacts(session_t *);
 static contact_t *find_contact_by_id(contact_t *, int);
 
+/*
+ * Number of seconds documents are taken from the cache without asking the
+ * pod. The -t option overrides these. Other documents are not cached.
+ */
+static const http_ttl_t ttls[] = {
+	{ "/contacts",		  60   },
+	{ "/conversations?page=", 30   },
+	{ "/people?q=",		  600  },
+	{ "/posts/",		  3600 },
+	{ NULL,			  0    }
+};
+
 int
 main(int argc, char *argv[])
 {
-	int	  ch, eflag, mflag, i, len, aspect_id, user_id, pm_id; 
+	int	  ch, eflag, mflag, i, len, aspect_id, user_id, pm_id, timeout;
 	bool	  public, have_cfg;
 	char	  *account, *host, *user, *pass, *p, *ans, *buf, url[256];
 	session_t *sp;
@@ -178,8 +197,9 @@ main(int argc, char *argv[])
 		warnx("Expect messed up output");
 	}
 
-	eflag = mflag = 0; account = NULL;
-	while ((ch = getopt(argc, argv, "a:emh")) != -1) {
+	eflag = mflag = 0; account = NULL; timeout = -1;
+	http_ttls = ttls;
+	while ((ch = getopt(argc, argv, "a:emoT:t:h")) != -1) {
 		switch (ch) {
 		case 'a':
 			account = optarg;
@@ -190,6 +210,19 @@ main(int argc, char *argv[])
 		case 'm':
 			mflag = 1;
 			break;
+		case 'o':
+			http_offline = true;
+			break;
+		case 't':
+			http_max_age = strtol(optarg, &p, 10);
+			if (*optarg == '\0' || *p != '\0' || http_max_age < 0)
+				errx(EXIT_FAILURE, "Invalid max. age: %s", optarg);
+			break;
+		case 'T':
+			timeout = strtol(optarg, &p, 10);
+			if (*optarg == '\0' || *p != '\0' || timeout < 0)
+				errx(EXIT_FAILURE, "Invalid timeout: %s", optarg);
+			break;
 		case 'h':
 		case '?':
 		default:
@@ -207,6 +240,7 @@ main(int argc, char *argv[])
 	(void)signal(SIGTERM, cleanup);
 	(void)signal(SIGHUP, cleanup);
 	(void)signal(SIGQUIT, cleanup);
+	(void)signal(SIGPIPE, SIG_IGN);
 
 	switch (read_config(account)) {
 	case  0:
@@ -218,6 +252,21 @@ main(int argc, char *argv[])
 	default:
 		have_cfg = false;
 	}
+	if (cfg.connect_timeout > 0)
+		ssl_connect_timeout = cfg.connect_timeout;
+	if (cfg.dns_ttl != 0)
+		dns_ttl = cfg.dns_ttl;
+	dns_stale = cfg.dns_stale;
+	ssl_ktls  = cfg.ktls;
+	http_h2	  = cfg.http2;
+	if (timeout < 0)
+		timeout = cfg.timeout;
+	if (timeout > 0) {
+		ssl_set_deadline(timeout);
+		/* For the case something blocks where the deadline can't reach. */
+		(void)signal(SIGALRM, deadline_exceeded);
+		(void)alarm(timeout + DEADLINE_GRACE);
+	}
 	sp = NULL;
 	if (strcmp(argv[0], "session") == 0) {
 		if (argc < 2)
@@ -300,15 +349,15 @@ main(int argc, char *argv[])
 			usage();
 		if ((sp = create_session()) == NULL)
 			errx(EXIT_FAILURE, "Failed to create session.");
-		if (like(sp, strtol(argv[1], NULL, 10)) == -1)
-			errx(EXIT_FAILURE, "Failed to \"like\" post");
+		if (like(sp, &argv[1]) == -1)
+			errx(EXIT_FAILURE, "Failed to \"like\" post(s)");
 	} else if (strcmp(argv[0], "delete") == 0) {
 		if (argc < 2)
 			usage();
 		if ((sp = create_session()) == NULL)
 			errx(EXIT_FAILURE, "Failed to create session.");
-		if (delete_post(sp, strtol(argv[1], NULL, 10)) == -1)
-			errx(EXIT_FAILURE, "Failed to delete post");
+		if (delete_post(sp, &argv[1]) == -1)
+			errx(EXIT_FAILURE, "Failed to delete post(s)");
 	} else if (strcmp(argv[0], "upload") == 0) {
 		if (argc < 3)
 			usage();
@@ -469,14 +518,15 @@ static void
 usage()
 {
 
-	(void)printf("Usage: cliaspora [options] command args ...\n"	      \
+	(void)printf("Usage: cliaspora [-o][-T timeout][-t max-age] command "  \
+	    "args ...\n"						      \
 	    "       cliaspora session new <handle> [password]\n"	      \
 	    "       cliaspora [-a account] add aspect <aspect-name> "	      \
 	    "<public|private>\n"					      \
-	    "       cliaspora [-a account] delete <post-ID>\n"		      \
+	    "       cliaspora [-a account] delete <post-ID> ...\n"	      \
 	    "       cliaspora [-a account] follow tag <tagname>\n"	      \
 	    "       cliaspora [-a account] follow user <handle> <aspect>\n"   \
-	    "       cliaspora [-a account] like <post-ID>\n"		      \
+	    "       cliaspora [-a account] like <post-ID> ...\n"	      \
 	    "       cliaspora [-a account] list contacts\n"		      \
 	    "       cliaspora [-a account] list messages\n"		      \
 	    "       cliaspora [-a account] list aspects\n"		      \
@@ -506,6 +556,14 @@ cleanup(int unused)
 	exit(EXIT_SUCCESS);
 }
 
+static void
+deadline_exceeded(int unused)
+{
+	delete_tmpfile();
+	warnx("Deadline exceeded");
+	_exit(EXIT_FAILURE);
+}
+
 static int
 get_pm_id(session_t *sp, const char *handle)
 {
@@ -524,31 +582,31 @@ get_pm_id(session_t *sp, const char *handle)
 		warnx("'%s' not found in your contacts", handle);
 		return (-1);
 	}
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
 	status = http_get(cp, ctp->url, sp->cookie, "*/*", USER_AGENT);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	} else if (status == -1) {
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	} else if (status != HTTP_OK) {
 		warnx("Server replied with code %d", status);
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	}
 	for (q = NULL; q == NULL && (p = ssl_readln(cp)) != NULL;)
 		q = strstr(p, "/conversations/new?contact_id=");
 	if (q == NULL) {
-		warnx("Unexpected server reply"); ssl_disconnect(cp);
+		warnx("Unexpected server reply"); http_pool_put(sp->pool, cp);
 		return (-1);
 	}
 	if (strtok(q, "=&\" ") == NULL ||
 	    (p = strtok(NULL, "=&\" ")) == NULL) {
-		warnx("Unexpected server reply"); ssl_disconnect(cp);
+		warnx("Unexpected server reply"); http_pool_put(sp->pool, cp);
 		return (-1);
 	}
 	id = strtol(p, NULL, 10);
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 	
 	return (id);
 }
@@ -557,43 +615,47 @@ static char *
 get_post_guid(session_t *sp, int id)
 {
 	int	    status;
+	size_t	    len;
 	ssl_conn_t  *cp;
 	json_node_t *node, *jp;
-	static char *p, *url, guid[64];
+	static char *p, *url, *body, guid[64];
 
 	errno = 0;
 	if ((url = strduprintf("/posts/%d", id)) == NULL)
 		return (NULL);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (NULL);
 	status = http_get(cp, url, sp->cookie, "application/json",
 	    USER_AGENT);
 	free(url);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp); return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	} else if (status == -1) {
-		ssl_disconnect(cp);
+		http_pool_put(sp->pool, cp);
 		return (NULL);
 	} else if (status != HTTP_OK) {
 		warnx("Server replied with code %d", status);
-		ssl_disconnect(cp); return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	}
-	while ((p = ssl_readln(cp)) != NULL && *p != '{')
+	body = http_read_body(cp, &len);
+	http_pool_put(sp->pool, cp);
+	if (body == NULL)
+		return (NULL);
+	for (p = body; isspace(*p); p++)
 		;
-	if (p == NULL) {
-		if (errno == 0)
-			warnx("Unexpected server reply");
-		ssl_disconnect(cp); return (NULL);
+	if (*p != '{') {
+		warnx("Unexpected server reply");
+		free(body); return (NULL);
 	}
 	if ((node = new_json_node()) == NULL) {
-		warn("new_json_node()"); ssl_disconnect(cp);
+		warn("new_json_node()"); free(body);
 		return (NULL);
 	}
 	if (parse_json(node, p) == NULL) {
-		ssl_disconnect(cp); return (NULL);
+		free(body); free_json_node(node); return (NULL);
 	}
-	ssl_disconnect(cp);
+	free(body);
 
 	for (jp = node->val; jp != NULL; jp = jp->next) {
 		if (jp->var != NULL && strcmp(jp->var, "guid") == 0)
@@ -612,14 +674,15 @@ static contact_t *
 lookup_user(session_t *sp, const char *handle)
 {
 	int	    status;
-	char	    *url, *p;
+	char	    *url, *p, *body;
+	size_t	    len;
 	contact_t   *contacts, *ctp;
 	ssl_conn_t  *cp;
 	json_node_t *node, *jp1, *jp2;
 
 	errno = 0;
 
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (NULL);
 	if ((url = strduprintf("/people?q=%s", handle)) == NULL)
 		return (NULL);
@@ -628,33 +691,32 @@ lookup_user(session_t *sp, const char *handle)
 	free(url);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp); return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	} else if (status == -1) {
-		ssl_disconnect(cp); return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	} else if (status != HTTP_OK) {
 		warnx("Server replied with code %d", status);
-		ssl_disconnect(cp); return (NULL);
-	}
-	jp1 = node = new_json_node();
-	if (node == NULL) {
-		ssl_disconnect(cp); return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	}
-	while ((p = ssl_readln(cp)) != NULL && *p != '[')
-		;
-	if (p == NULL) {
-		warnx("Unexpected server answer"); ssl_disconnect(cp);
+	body = http_read_body(cp, &len);
+	http_pool_put(sp->pool, cp);
+	if (body == NULL)
 		return (NULL);
-	}
+	for (p = body; isspace(*p); p++)
+		;
 	if (*p != '[') {
-		if (errno == 0)
-			warnx("Server reply not understood");
-		ssl_disconnect(cp); return (NULL);
+		warnx("Server reply not understood");
+		free(body); return (NULL);
+	}
+	jp1 = node = new_json_node();
+	if (node == NULL) {
+		free(body); return (NULL);
 	}
 	if (parse_json(node, p) == NULL) {
-		ssl_disconnect(cp); free_json_node(node);
+		free(body); free_json_node(node);
 		return (NULL);
 	}
-	ssl_disconnect(cp);
+	free(body);
 	
 	for (contacts = NULL, jp1 = node->val; jp1 != NULL; jp1 = jp1->next) {
 		if (contacts == NULL) {
@@ -698,38 +760,38 @@ error:
 }	
 
 static char *
-diaspora_login(const char *host, u_short port, const char *user,
-	       const char *pass)
+diaspora_login(session_t *sp, const char *user, const char *pass)
 {
 	int	   status, tries;
-	char	   *cookie, *scookie, *rq, *p, *q, *u, *head, *url, *atok;
-	ssl_conn_t *cp;
-	const char tmpl[] = "utf8=%%E2%%9C%%93&user%%5Busername%%5D=%s&"  \
-                            "user%%5Bpassword%%5D=%s&user%%5Bremember_me" \
-			    "%%5D=1&commit=Sign+in&authenticity_token=%s";
+	char	     *cookie, *scookie, *p, *q, *head, *url, *atok;
+	ssl_conn_t   *cp;
+	const char   *c;
+	http_field_t form[] = {
+		{ "utf8",		"\xe2\x9c\x93" },
+		{ "user[username]",	NULL	       },
+		{ "user[password]",	NULL	       },
+		{ "user[remember_me]",	"1"	       },
+		{ "commit",		"Sign in"      },
+		{ "authenticity_token",	NULL	       }
+	};
 
 	errno = 0;
-	if ((cp = ssl_connect(host, port)) == NULL) {
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
 		return (NULL);
 	}
 	status = http_get(cp, "/users/sign_in", NULL, "*/*", USER_AGENT);
 	if (status != 200) {
 		warnx("Login failed. Server replied with code %d", status);
-		return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	}
 	scookie = atok = NULL;
-	while ((p = ssl_readln(cp)) != NULL && atok == NULL) {
-		if (strncmp(p, "Set-Cookie:", 11) == 0) {
-			for (q = p; (q = strtok(q, " ;")) != NULL; q = NULL) {
-				if (strncmp(q, "_diaspora_session=", 18) != 0)
-					continue;
-				if ((scookie = strdup(q)) == NULL) {
-					warn("strdup()"); ssl_disconnect(cp);
-					return (NULL);
-				}
-			}
-		} else if ((q = strstr(p, "name=\"authenticity_token\"")) !=
-		    NULL) {
+	if ((c = http_cookie(http_reply(cp), "_diaspora_session")) != NULL &&
+	    (scookie = strdup(c)) == NULL) {
+		warn("strdup()"); http_pool_put(sp->pool, cp);
+		return (NULL);
+	}
+	while (atok == NULL && (p = ssl_readln(cp)) != NULL) {
+		if ((q = strstr(p, "name=\"authenticity_token\"")) != NULL) {
 			if ((p = strstr(q, "value=")) != NULL) {
 				while (*p != '\0' && *p != '=')
 					p++;
@@ -744,56 +806,46 @@ diaspora_login(const char *host, u_short port, const char *user,
 			}
 		}
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 	if (atok == NULL)
 		warnx("Couldn't get authenticity token");
 	if (scookie == NULL)
 		warnx("Couldn't get session cookie");
 
-	rq = u = p = head = url = NULL;
-	if ((u = urlencode(user)) == NULL || (p = urlencode(pass)) == NULL) {
-		free(u); free(p); return (NULL);
-	}
-	if ((rq = strduprintf(tmpl, u, p, atok == NULL ? "" : atok)) == NULL) {
-		free(u); free(p); return (NULL);
-	}
-	free(u); free(p);
+	p = head = url = NULL;
+	form[1].value = user;
+	form[2].value = pass;
+	form[5].value = atok == NULL ? "" : atok;
 
+	/*
+	 * Some pods set the cookie late. LOGIN_RETRIES backoff pauses give
+	 * them 16 to 32 seconds.
+	 */
 	tries = 0;
 	do {
-		if (tries > 0)
-			sleep(2);
-		if ((cp = ssl_connect(host, port)) == NULL) {
-			free(rq); return (NULL);
-		}
-		status = http_post(cp, "/users/sign_in", scookie, "*/*",
-		    USER_AGENT, HTTP_POST_TYPE_FORM, rq);
+		if ((cp = http_pool_get(sp->pool)) == NULL)
+			return (NULL);
+		status = http_post_form(cp, "/users/sign_in", scookie, "*/*",
+		    USER_AGENT, form, sizeof(form) / sizeof(form[0]));
 		if (status >= 400) {
 			warnx("Login failed. Server replied with code %d",
 			    status);
+			http_pool_put(sp->pool, cp); return (NULL);
+		} else if (status == -1) {
+			http_pool_put(sp->pool, cp); return (NULL);
+		}
+		cookie = NULL;
+		if ((c = http_cookie(http_reply(cp),
+		    "remember_user_token")) != NULL &&
+		    (cookie = strdup(c)) == NULL) {
+			warn("strdup()");
+			http_pool_put(sp->pool, cp);
 			return (NULL);
-		} else if (status == -1)
-			return (NULL);
-		for (cookie = NULL;
-		    (p = ssl_readln(cp)) != NULL && cookie == NULL;) {
-			if (strncmp(p, "Set-Cookie:", 11) == 0) {
-				for (q = p; (q = strtok(q, " ;")) != NULL;
-				    q = NULL) {
-					if (strncmp(q,
-					    "remember_user_token=", 20) != 0)
-						continue;
-					if ((cookie = strdup(q)) == NULL) {
-						warn("strdup()");
-						ssl_disconnect(cp);
-						return (NULL);
-					}
-				}
-			}
 		}
-		ssl_disconnect(cp);
-	} while (cookie == NULL && ++tries < 10);
+		http_pool_put(sp->pool, cp);
+	} while (cookie == NULL && http_backoff(tries++, LOGIN_RETRIES) == 0);
 
-	free(rq); free(scookie); free(atok);
+	free(scookie); free(atok);
 
 	if (cookie == NULL) {
 		if (errno == 0)
@@ -810,7 +862,7 @@ close_session(session_t *sp)
 	ssl_conn_t *cp;
 	const char *tmpl = "_method=delete";
 
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
 	status = http_post(cp, "/users/sign_out", sp->cookie, "*/*",
 	    USER_AGENT, HTTP_POST_TYPE_FORM, tmpl);
@@ -823,7 +875,7 @@ close_session(session_t *sp)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -851,7 +903,7 @@ post(session_t *sp, const char *msg, const char *aspect)
 		free(p); return (-1);
 	}
 	free(p);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
 	status = http_post(cp, "/status_messages", sp->cookie, NULL,
 	    USER_AGENT, HTTP_POST_TYPE_JSON, rq);
@@ -867,7 +919,7 @@ post(session_t *sp, const char *msg, const char *aspect)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -903,7 +955,7 @@ dpoll(session_t *sp, const char *aspect, const char *msg, const char *question,
 	free(mp); free(qp);
 	if (rq == NULL)
 		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
 		free(rq); return (-1);
 	}
 	status = http_post(cp, "/status_messages", sp->cookie, NULL,
@@ -920,7 +972,7 @@ dpoll(session_t *sp, const char *aspect, const char *msg, const char *question,
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 	return (ret);
 }
 
@@ -929,7 +981,9 @@ upload(session_t *sp, const char *aspect, const char *msg, char * const *files)
 {
 	int	   aid, i, j, n, ret, status, id[24];
 	char	   *rq, *p, idstr[24], lst[sizeof(id) * (20 + 3) / sizeof(int)];
+	char	   *url[sizeof(id) / sizeof(int)];
 	ssl_conn_t *cp;
+	http_job_t job[sizeof(id) / sizeof(int)];
 	const char tmpl[] = "{\"status_message\":{\"text\":\"%s\","	\
 			    "\"provider_display_name\":\"cliaspora\"}," \
 			    "\"aspect_ids\":\"%s\",\"photos\":[%s]}";
@@ -941,13 +995,30 @@ upload(session_t *sp, const char *aspect, const char *msg, char * const *files)
                 warnx("Unknown aspect '%s'", aspect); return (-1);
 	} else
 		(void)snprintf(idstr, sizeof(idstr), "%d", aid);
-	for (n = 0; n < sizeof(id) / sizeof(int) && *files != NULL; files++) {
-		if ((id[n] = upload_file(sp, *files)) == -1)
-			warnx("Failed to upload image '%s'", *files);
+	(void)memset(job, 0, sizeof(job));
+	for (n = 0; n < sizeof(id) / sizeof(int) && files[n] != NULL; n++) {
+		if ((url[n] = photo_url(files[n])) == NULL) {
+			while (--n >= 0)
+				free(url[n]);
+			return (-1);
+		}
+		job[n].url    = url[n];
+		job[n].file   = files[n];
+		job[n].type   = HTTP_RQ_TYPE_POST;
+		job[n].agent  = USER_AGENT;
+		job[n].cookie = sp->cookie;
+		job[n].accept = "application/json";
+	}
+	/* Upload the files in parallel, but keep their order in the post. */
+	(void)http_run(sp->pool, job, n, HTTP_MAX_CONNS);
+	for (i = j = 0; i < n; i++) {
+		if ((id[j] = photo_id(&job[i])) == -1)
+			warnx("Failed to upload image '%s'", files[i]);
 		else
-			n++;
+			j++;
+		free(job[i].body); free(url[i]);
 	}
-	if (n <= 0)
+	if ((n = j) <= 0)
 		return (-1);
 	for (i = j = 0; i < n; i++) {
 		(void)snprintf(lst + j, sizeof(lst) - j,
@@ -963,7 +1034,7 @@ upload(session_t *sp, const char *aspect, const char *msg, char * const *files)
 	free(p);
 	if (rq == NULL)
 		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
 		free(rq); return (-1);
 	}
 	status = http_post(cp, "/status_messages", sp->cookie, NULL,
@@ -980,59 +1051,64 @@ upload(session_t *sp, const char *aspect, const char *msg, char * const *files)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 	return (ret);
 }
 
-static int
-upload_file(session_t *sp, const char *file)
+/*
+ * Returns the URL to upload the given image file to.
+ */
+static char *
+photo_url(const char *file)
 {
-	int	    status, id;
-	char	    *url, *p;
-	ssl_conn_t  *cp;
-	json_node_t *node, *jp1, *jp2, *jp3;
+	char *url, *p;
 
-	errno = 0;
 	if ((p = strrchr(file, '/')) != NULL)
 		p++;
 	else
 		p = (char *)file;
 	if ((p = urlencode(p)) == NULL)
-		return (-1);
-	if ((url = strduprintf("/photos?photo%%5Bpending%%5D=true&" \
-	    "set_profile_image=&qqfile=%s", p)) == NULL) {
-		free(p); return (-1);
-	}
+		return (NULL);
+	url = strduprintf("/photos?photo%%5Bpending%%5D=true&" \
+	    "set_profile_image=&qqfile=%s", p);
 	free(p);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
-		free(url); return (-1);
-	}
-	status = http_upload(cp, url, sp->cookie, "application/json",
-	    USER_AGENT, file);
-	free(url);
-	if (status == HTTP_UNAUTHORIZED) {
+
+	return (url);
+}
+
+/*
+ * Evaluates the reply to an image upload.
+ *
+ * Returns the ID of the uploaded image, or -1 on error.
+ */
+static int
+photo_id(http_job_t *job)
+{
+	int	    id;
+	char	    *p;
+	json_node_t *node, *jp1, *jp2, *jp3;
+
+	errno = 0;
+	if (job->status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp); return (-1);
-	} else if (status == -1) {
-		ssl_disconnect(cp); return (-1);
-	} else if (status != HTTP_CREATED && status != HTTP_OK) {
-		warnx("Server replied with code %d", status);
-		ssl_disconnect(cp); return (-1);
-	}	
-	while ((p = ssl_readln(cp)) != NULL && *p != '{')
-		;
-	if (p == NULL) {
-		warnx("Unexpected server reply"); ssl_disconnect(cp);
+		return (-1);
+	} else if (job->status == -1)
+		return (-1);
+	else if (job->status != HTTP_CREATED && job->status != HTTP_OK) {
+		warnx("Server replied with code %d", job->status);
 		return (-1);
 	}
-	if ((node = new_json_node()) == NULL) {
-		ssl_disconnect(cp); return (-1);
+	for (p = job->body; p != NULL && isspace(*p); p++)
+		;
+	if (p == NULL || *p != '{') {
+		warnx("Unexpected server reply");
+		return (-1);
 	}
-	if (parse_json(node, p) == NULL) {
-		ssl_disconnect(cp); free_json_node(node);
+	if ((node = new_json_node()) == NULL)
 		return (-1);
+	if (parse_json(node, p) == NULL) {
+		free_json_node(node); return (-1);
 	}
-	ssl_disconnect(cp);
 	for (id = -1, jp1 = node->val; jp1 != NULL; jp1 = jp1->next) {
 		if (strcmp(jp1->var, "data") == 0) {
 			for (jp2 = jp1->val; jp2 != NULL; jp2 = jp2->next) {
@@ -1075,7 +1151,7 @@ comment(session_t *sp, const char *msg, int id)
 		free(p); free(url); return (-1);
 	}
 	free(p);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
 	status = http_post(cp, url, sp->cookie, NULL,
 	    USER_AGENT, HTTP_POST_TYPE_JSON, rq);
@@ -1091,98 +1167,103 @@ comment(session_t *sp, const char *msg, int id)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
 
+/*
+ * Sends a request of the given type for each of the posts 'ids' to the
+ * URL 'fmt'. The requests are pipelined on one connection.
+ *
+ * Returns 0 if the server replied with 'want' to all requests, and -1
+ * otherwise.
+ */
 static int
-like(session_t *sp, int id)
+post_batch(session_t *sp, char * const *ids, int type, const char *fmt,
+	   int want)
 {
-	int	   status, ret;
+	int	   i, n, ret;
 	char	   *url;
-	ssl_conn_t *cp;
-	
+	http_job_t *job;
+
 	errno = 0;
-	if ((url = strduprintf("/posts/%d/likes", id)) == NULL)
-		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
-		free(url); return (-1);
+	for (n = 0; ids[n] != NULL; n++)
+		;
+	if ((job = calloc(n, sizeof(http_job_t))) == NULL) {
+		warn("calloc()"); return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		url = strduprintf(fmt, (int)strtol(ids[i], NULL, 10));
+		if ((job[i].url = url) == NULL) {
+			while (--i >= 0)
+				free((char *)job[i].url);
+			free(job);
+			return (-1);
+		}
+		job[i].type   = type;
+		job[i].agent  = USER_AGENT;
+		job[i].cookie = sp->cookie;
+		if (type == HTTP_RQ_TYPE_POST) {
+			job[i].ctype   = HTTP_POST_TYPE_JSON;
+			job[i].content = "[]";
+		}
 	}
-	status = http_post(cp, url, sp->cookie, NULL,
-	    USER_AGENT, HTTP_POST_TYPE_JSON, "[]");
-	free(url);
-	if (status == HTTP_UNAUTHORIZED) {
-		warnx("You're not logged in. Please create a new session");
-		ret = -1;
-	} else if (status == -1)
-		ret = -1;
-	else if (status == HTTP_CREATED)
-		ret = 0;
-	else {
-		warnx("Server replied with code %d", status);
-		ret = -1;
+	(void)http_pipeline(sp->pool, job, n);
+	for (i = ret = 0; i < n; i++) {
+		if (job[i].status == HTTP_UNAUTHORIZED) {
+			warnx("You're not logged in. Please create a new " \
+			    "session");
+			ret = -1;
+		} else if (job[i].status == -1) {
+			warnx("Request for post %s failed", ids[i]);
+			ret = -1;
+		} else if (job[i].status != want) {
+			warnx("Server replied with code %d for post %s",
+			    job[i].status, ids[i]);
+			ret = -1;
+		}
+		free(job[i].body); free((char *)job[i].url);
 	}
-	ssl_disconnect(cp);
+	free(job);
 
 	return (ret);
 }
 
 static int
-delete_post(session_t *sp, int id)
+like(session_t *sp, char * const *ids)
 {
-	int	   status, ret;
-	char	   *url;
-	ssl_conn_t *cp;
-	
-	errno = 0;
-	if ((url = strduprintf("/posts/%d", id)) == NULL)
-		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
-		free(url); return (-1);
-	}
-	status = http_delete(cp, url, sp->cookie, USER_AGENT);
-	free(url);
-	if (status == HTTP_UNAUTHORIZED) {
-		warnx("You're not logged in. Please create a new session");
-		ret = -1;
-	} else if (status == HTTP_FOUND)
-		ret = 0;
-	else if (status == -1)
-		ret = -1;
-	else {
-		warnx("Server replied with code %d", status);
-		ret = -1;
-	}
-	ssl_disconnect(cp);
+	return (post_batch(sp, ids, HTTP_RQ_TYPE_POST, "/posts/%d/likes",
+	    HTTP_CREATED));
+}
 
-	return (ret);
+static int
+delete_post(session_t *sp, char * const *ids)
+{
+	return (post_batch(sp, ids, HTTP_RQ_TYPE_DELETE, "/posts/%d",
+	    HTTP_FOUND));
 }
 
 static int
 message(session_t *sp, const char *subject, const char *msg, int id)
 {
-	int	   ret, status;
-	char	   *rq, *m, *s;
-	ssl_conn_t *cp;
-	const char tmpl[] = "contact_ids=%d&conversation%%5bsubject" \
-			    "%%5d=%s&conversation%%5btext%%5d=%s\n";
+	int	     ret, status;
+	char	     ids[12];
+	ssl_conn_t   *cp;
+	http_field_t form[3];
 
 	errno = 0;
-	if ((m = urlencode(msg)) == NULL)
-		return (-1);
-	if ((s = urlencode(subject)) == NULL) {
-		free(m); return (-1);
-	}
-	if ((rq = strduprintf(tmpl, id, s, m)) == NULL) {
-		free(m); free(s); return (-1);
-	}
-	free(m); free(s);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	(void)snprintf(ids, sizeof(ids), "%d", id);
+	form[0].name  = "contact_ids";
+	form[0].value = ids;
+	form[1].name  = "conversation[subject]";
+	form[1].value = subject;
+	form[2].name  = "conversation[text]";
+	form[2].value = msg;
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
-	status = http_post(cp, "/conversations", sp->cookie, NULL,
-	    USER_AGENT, HTTP_POST_TYPE_FORM, rq);
-	free(rq);
+	status = http_post_form(cp, "/conversations", sp->cookie, NULL,
+	    USER_AGENT, form, 3);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
 		ret = -1;
@@ -1194,7 +1275,7 @@ message(session_t *sp, const char *subject, const char *msg, int id)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -1202,27 +1283,24 @@ message(session_t *sp, const char *subject, const char *msg, int id)
 static int
 reply(session_t *sp, const char *msg, int msg_id)
 {
-	int	   ret, status;
-	char	   *rq, *url, *p;
-	ssl_conn_t *cp;
+	int	     ret, status;
+	char	     *url;
+	ssl_conn_t   *cp;
+	http_field_t form;
 
 	errno = 0;
 
-	if ((p = urlencode(msg)) == NULL)
-		return (-1);
 	if ((url = strduprintf("/conversations/%d/messages",
-	    msg_id)) == NULL) {
-		free(p); return (-1);
-	}
-	if ((rq = strduprintf("message%%5btext%%5d=%s\n", p)) == NULL) {
-		free(p); free(url); return (-1);
-	}
-	free(p);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	    msg_id)) == NULL)
 		return (-1);
-	status = http_post(cp, url, sp->cookie, NULL, USER_AGENT,
-	    HTTP_POST_TYPE_FORM, rq);
-	free(url); free(rq);
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
+		free(url); return (-1);
+	}
+	form.name  = "message[text]";
+	form.value = msg;
+	status = http_post_form(cp, url, sp->cookie, NULL, USER_AGENT, &form,
+	    1);
+	free(url);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
 		ret = -1;
@@ -1234,7 +1312,7 @@ reply(session_t *sp, const char *msg, int msg_id)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 	return (ret);
 }
 
@@ -1251,7 +1329,7 @@ reshare(session_t *sp, int id)
 		return (-1);
 	if ((rq = strduprintf(tmpl, guid)) == NULL)
 		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
 		free(rq); return (-1);
 	}
 	status = http_post(cp, "/reshares", sp->cookie, NULL,
@@ -1268,7 +1346,7 @@ reshare(session_t *sp, int id)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -1276,21 +1354,19 @@ reshare(session_t *sp, int id)
 static int
 add_aspect(session_t *sp, const char *name, bool visible)
 {
-	int	   status, ret;
-	char	   *rq;
-	ssl_conn_t *cp;
-	const char tmpl[] = "aspect%%5bname%%5d=%s&aspect%%5b" \
-			    "contacts_visible%%5d=%d";
+	int	     status, ret;
+	ssl_conn_t   *cp;
+	http_field_t form[2];
 
 	errno = 0;
-	if ((rq = strduprintf(tmpl, name, visible ? 1 : 0)) == NULL)
+	form[0].name  = "aspect[name]";
+	form[0].value = name;
+	form[1].name  = "aspect[contacts_visible]";
+	form[1].value = visible ? "1" : "0";
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
-		free(rq); return (-1);
-	}
-	status = http_post(cp, "/aspects", sp->cookie, NULL,
-	    USER_AGENT, HTTP_POST_TYPE_FORM, rq);
-	free(rq);
+	status = http_post_form(cp, "/aspects", sp->cookie, NULL,
+	    USER_AGENT, form, 2);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
 		ret = -1;
@@ -1302,7 +1378,7 @@ add_aspect(session_t *sp, const char *name, bool visible)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -1324,7 +1400,7 @@ follow_tag(session_t *sp, const char *tag)
 		free(p); return (-1);
 	}
 	free(p);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
 		free(rq); return (-1);
 	}
 	status = http_post(cp, "/tag_followings", sp->cookie, NULL,
@@ -1341,7 +1417,7 @@ follow_tag(session_t *sp, const char *tag)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -1357,7 +1433,7 @@ add_contact(session_t *sp, int aspect, int id)
 	errno = 0;
 	if ((rq = strduprintf(tmpl, aspect, id)) == NULL)
 		return (-1);
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL) {
+	if ((cp = http_pool_get(sp->pool)) == NULL) {
 		free(rq);
 		return (-1);
 	}
@@ -1375,7 +1451,7 @@ add_contact(session_t *sp, int aspect, int id)
 		warnx("Server replied with code %d", status);
 		ret = -1;
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	return (ret);
 }
@@ -1383,6 +1459,7 @@ add_contact(session_t *sp, int aspect, int id)
 static void
 free_session(session_t *sp)
 {
+	http_pool_free(sp->pool);
 	free(sp->cookie);
 	free(sp->host);
 	free(sp);
@@ -1403,9 +1480,12 @@ new_session(const char *host, u_short port, const char *user, const char *pass)
 	sp->attr.aspects = NULL;
 
 	if ((sp->host = strdup(host)) == NULL) {
-		free_session(sp); return (NULL);
+		free(sp); return (NULL);
+	}
+	if ((sp->pool = http_pool_new(host, port)) == NULL) {
+		free(sp->host); free(sp); return (NULL);
 	}
-	sp->cookie = diaspora_login(host, port, user, pass);
+	sp->cookie = diaspora_login(sp, user, pass);
 	if (sp->cookie == NULL)
 		return (NULL);
 	if (get_attributs(sp) == -1) {
@@ -1450,6 +1530,10 @@ create_session()
 	sp->attr.name	 = sp->attr.did = NULL;
 	sp->attr.aspects = NULL;
 
+	if ((sp->pool = http_pool_new(sp->host, sp->port)) == NULL) {
+		free(sp); return (NULL);
+	}
+
 	if (get_attributs(sp) == -1) {
 		free_session(sp); return (NULL);
 	}
@@ -1465,14 +1549,15 @@ get_attributs(session_t *sp)
 	json_node_t *jnode, *jp;
 
 	errno = 0;
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	q = NULL;
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
 	status = http_get(cp, "/stream", sp->cookie, "*/*", USER_AGENT);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	} else if (status == -1) {
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	}
 	while ((p = ssl_readln(cp)) != NULL) {
 		if ((q = strstr(p, "gon.user")) != NULL ||
@@ -1480,7 +1565,7 @@ get_attributs(session_t *sp)
 			break;
 	}
 	if (q == NULL) {
-		warnx("Unexpected server reply"); ssl_disconnect(cp);
+		warnx("Unexpected server reply"); http_pool_put(sp->pool, cp);
 		return (-1);
 	}
 	p = q;
@@ -1503,7 +1588,7 @@ get_attributs(session_t *sp)
 	if (parse_json(jnode, q) == NULL) {
 		free_json_node(jnode); return (-1);
 	}
-	ssl_disconnect(cp);
+	http_pool_put(sp->pool, cp);
 
 	free(sp->attr.name);
 	free(sp->attr.did);
@@ -1672,47 +1757,64 @@ free_msg_idx(msg_idx_t *idx)
 static msg_idx_t *
 get_msg_index(session_t *sp)
 {
-	int	    page, status;
+	int	    i, n, page, status;
 	bool	    complete, error;
 	msg_idx_t   *index, *ip;
 	const char  tmpl[] = "/conversations?page=%d";
-	char	    url[sizeof(tmpl) + 16], *p;
-	ssl_conn_t  *cp;
+	char	    url[HTTP_MAX_CONNS][sizeof(tmpl) + 16], *p;
+	http_job_t  job[HTTP_MAX_CONNS];
 	json_node_t *node, *jp1, *jp2, *jp3, *jp4;
 	errno = 0;
 
 	jp1 = node = new_json_node();
 	if (node == NULL)
 		return (NULL);
-	for (complete = error = false, page = 1; !error && !complete; page++) {
-		(void)snprintf(url, sizeof(url), tmpl, page);
-		if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
-			return (NULL);
-		status = http_get(cp, url, sp->cookie,
-		    "application/json, */*", USER_AGENT);
-		if (status == HTTP_UNAUTHORIZED) {
-			warnx("You're not logged in. Please create a " \
-			    "new session");
-			error = true;
-		} else if (status != HTTP_OK && status != HTTP_FOUND) {
-			error = true;
-			warnx("Server replied with code %d", status);
-		} else if (status == -1)
+	/*
+	 * The number of pages is unknown, so we request them in parallel
+	 * waves of growing size until we get an empty page.
+	 */
+	for (complete = error = false, page = 1, n = 1; !error && !complete;
+	    page += n, n = n * 2 > HTTP_MAX_CONNS ? HTTP_MAX_CONNS : n * 2) {
+		(void)memset(job, 0, sizeof(job));
+		for (i = 0; i < n; i++) {
+			(void)snprintf(url[i], sizeof(url[i]), tmpl, page + i);
+			job[i].url    = url[i];
+			job[i].type   = HTTP_RQ_TYPE_GET;
+			job[i].agent  = USER_AGENT;
+			job[i].cookie = sp->cookie;
+			job[i].accept = "application/json, */*";
+		}
+		if (http_run(sp->pool, job, n, n) == -1)
 			error = true;
-		while (!error && !complete && (p = ssl_readln(cp)) != NULL) {
-			if (strncmp(p, "[]", 2) == 0)
-				complete = true;
-			else if (*p == '[') {
-				if (parse_json(jp1, p) == NULL)
-					error = true;
-				break;
+		for (i = 0; i < n; i++) {
+			status = job[i].status;
+			if (error || complete) {
+				free(job[i].body);
+				continue;
 			}
-		}
-		if (!error && !complete) {
-			if ((jp1 = json_add_node(jp1)) == NULL)
+			if (status == HTTP_UNAUTHORIZED) {
+				warnx("You're not logged in. Please create a " \
+				    "new session");
 				error = true;
+			} else if (status == -1)
+				error = true;
+			else if (status != HTTP_OK && status != HTTP_FOUND) {
+				error = true;
+				warnx("Server replied with code %d", status);
+			} else if ((p = job[i].body) != NULL) {
+				while (isspace(*p))
+					p++;
+				if (strncmp(p, "[]", 2) == 0)
+					complete = true;
+				else if (*p == '[') {
+					if (parse_json(jp1, p) == NULL)
+						error = true;
+					else if ((jp1 = json_add_node(jp1)) == NULL)
+						error = true;
+				}
+			}
+			free(job[i].body);
 		}
-		ssl_disconnect(cp);
 	}
 	if (error) {
 		free_json_node(node);
@@ -1819,43 +1921,47 @@ static contact_t *
 get_contacts(session_t *sp)
 {
 	int	    status;
-	char	    *p;
+	char	    *p, *body;
+	size_t	    len;
 	contact_t   *contacts, *ctp;
 	ssl_conn_t  *cp;
 	json_node_t *node, *jp1, *jp2;
 
 	errno = 0;
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (NULL);
 	status = http_get(cp, "/contacts", sp->cookie,
 	    "application/json, */*", USER_AGENT);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp);
+		http_pool_put(sp->pool, cp);
 		return (NULL);
 	} else if (status == -1) {
-		ssl_disconnect(cp);
+		http_pool_put(sp->pool, cp);
 		return (NULL);
 	} else if (status != HTTP_OK && status != HTTP_FOUND) {
 		warnx("Server replied with code %d", status);
-		ssl_disconnect(cp); return (NULL);
+		http_pool_put(sp->pool, cp); return (NULL);
 	}
-	jp1 = node = new_json_node();
-	if (node == NULL)
+	body = http_read_body(cp, &len);
+	http_pool_put(sp->pool, cp);
+	if (body == NULL)
 		return (NULL);
-	while ((p = ssl_readln(cp)) != NULL && *p != '[')
+	for (p = body; isspace(*p); p++)
 		;
 	if (*p != '[') {
-		if (errno == 0)
-			warnx("Server reply not understood");
-		ssl_disconnect(cp);
-		return (NULL);
+		warnx("Server reply not understood");
+		free(body); return (NULL);
+	}
+	jp1 = node = new_json_node();
+	if (node == NULL) {
+		free(body); return (NULL);
 	}
 	if (parse_json(node, p) == NULL) {
-		ssl_disconnect(cp); free_json_node(node);
+		free(body); free_json_node(node);
 		return (NULL);
 	}
-	ssl_disconnect(cp);
+	free(body);
 	
 	for (contacts = NULL, jp1 = node->val; jp1 != NULL; jp1 = jp1->next) {
 		if (contacts == NULL) {
@@ -2097,38 +2203,43 @@ static int
 read_stream(session_t *sp, const char *url)
 {
 	int	   status;
-	char	   *p;
+	char	   *p, *body;
+	size_t	   len;
 	ssl_conn_t *cp;
 	json_node_t *node, *pstp;
 
-	if ((cp = ssl_connect(sp->host, sp->port)) == NULL)
+	if ((cp = http_pool_get(sp->pool)) == NULL)
 		return (-1);
 	status = http_get(cp, url, sp->cookie,
 	    "application/json, */*", USER_AGENT);
 	if (status == HTTP_UNAUTHORIZED) {
 		warnx("You're not logged in. Please create a new session");
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	} else if (status == -1) {
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	} else if (status != HTTP_OK) {
 		warnx("Server replied with code %d", status);
-		ssl_disconnect(cp); return (-1);
-	}
-	if ((node = new_json_node()) == NULL) {
-		warnx("new_json_node()");
-		ssl_disconnect(cp); return (-1);
+		http_pool_put(sp->pool, cp); return (-1);
 	}
-	while ((p = ssl_readln(cp)) != NULL && *p != '[')
+	body = http_read_body(cp, &len);
+	http_pool_put(sp->pool, cp);
+	if (body == NULL)
+		return (-1);
+	for (p = body; isspace(*p); p++)
 		;
-	if (p == NULL) {
+	if (*p != '[') {
 		warnx("Unexpected server reply");
-		ssl_disconnect(cp); return (-1);
+		free(body); return (-1);
+	}
+	if ((node = new_json_node()) == NULL) {
+		warnx("new_json_node()"); free(body);
+		return (-1);
 	}
 	if (parse_json(node, p) == NULL) {
 		warnx("parse_json() failed");
-		ssl_disconnect(cp); return (-1);
+		free(body); free_json_node(node); return (-1);
 	}
-	ssl_disconnect(cp);
+	free(body);
 	for (pstp = node->val; pstp != NULL; pstp = pstp->next)
 		show_post(pstp->val);
 	free_json_node(node);
@@ -67,7 +67,14 @@ var_t vars[] = {
 	{ "user",   false, VAR_STRING,  (val_t)&cfg.user   },
 	{ "cookie", false, VAR_STRING,  (val_t)&cfg.cookie },
 	{ "editor", true,  VAR_STRING,  (val_t)&cfg.editor },
-	{ "port",   false, VAR_INTEGER, (val_t)&cfg.port   }
+	{ "port",   false, VAR_INTEGER, (val_t)&cfg.port   },
+	{ "connect_timeout", true, VAR_INTEGER,
+	  (val_t)&cfg.connect_timeout },
+	{ "timeout",   true, VAR_INTEGER, (val_t)&cfg.timeout	},
+	{ "dns_ttl",   true, VAR_INTEGER, (val_t)&cfg.dns_ttl   },
+	{ "dns_stale", true, VAR_BOOLEAN, (val_t)&cfg.dns_stale },
+	{ "ktls",      true, VAR_BOOLEAN, (val_t)&cfg.ktls	},
+	{ "http2",     true, VAR_BOOLEAN, (val_t)&cfg.http2	}
 
 };
 #define NVARS (sizeof(vars) / sizeof(var_t))
@@ -307,8 +314,11 @@ parse_line(char *str)
 	return (-1);
 }
 
+/*
+ * Returns the path of the given file in the user's home directory.
+ */
 char *
-cfgpath()
+homepath(const char *file)
 {
 	int	      len;
 	char	      *path;
@@ -319,15 +329,21 @@ cfgpath()
 		return (NULL);
 	}
 	endpwent();
-	len = strlen(pw->pw_dir) + sizeof(PATH_CONFIG) + 1;
+	len = strlen(pw->pw_dir) + strlen(file) + 2;
 	if ((path = malloc(len)) == NULL) {
 		warn("malloc()"); return (NULL);
 	}
-	(void)snprintf(path, len, "%s/%s", pw->pw_dir, PATH_CONFIG);
+	(void)snprintf(path, len, "%s/%s", pw->pw_dir, file);
 
 	return (path);
 }
 
+char *
+cfgpath()
+{
+	return (homepath(PATH_CONFIG));
+}
+
 int
 read_config(const char *label)
 {
@@ -444,9 +460,9 @@ write_config(const char *label)
 			}
 		}
 	}
-	/* Write remaining variables. */
+	/* Write remaining variables. Global variables are left to the user. */
 	for (i = 0; i < NVARS; i++) {
-		if (!var_written[i])
+		if (!var_written[i] && !vars[i].global)
 			(void)write_var(&vars[i], tmpfp);
 	}
 	/* Copy the remaining lines. */ 
@@ -32,6 +32,12 @@
 
 typedef struct config_s {
 	int  port;
+	int  connect_timeout;	/* Connect deadline in seconds. */
+	int  timeout;		/* Deadline of a command in seconds. */
+	int  dns_ttl;		/* Lifetime of cached addresses. */
+	bool dns_stale;		/* Use expired cache entries. */
+	bool ktls;		/* Let the kernel encrypt uploads. */
+	bool http2;		/* Offer HTTP/2 to the pod. */
 	char *user;
 	char *host;
 	char *cookie;
@@ -42,6 +48,7 @@ extern config_t cfg;
 extern int  read_config(const char *);
 extern int  write_config(const char *);
 extern char *cfgpath(void);
+extern char *homepath(const char *);
 
 #endif	/* !_CONFIG_H_ */
 
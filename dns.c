@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2015 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <errno.h>
+
+#include "types.h"
+#include "dns.h"
+#include "cache.h"
+
+/*
+ * Resolver with a persistent cache. Cache entries in PATH_DNSCACHE have
+ * the form "host expiry addr,addr,...", or "host expiry -" for names
+ * that couldn't be resolved. getaddrinfo() doesn't tell us the TTL of
+ * the records, so addresses are cached for 'dns_ttl' seconds.
+ */
+
+int  dns_ttl   = DNS_TTL;	/* < 0 disables the cache. */
+bool dns_stale = false;		/* Use expired entries, and refresh them. */
+
+static void
+set_port(dns_addr_t *addr, u_short port)
+{
+	if (addr->sa.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr->sa)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *)&addr->sa)->sin_port = htons(port);
+}
+
+static bool
+parse_addr(const char *str, dns_addr_t *addr)
+{
+	struct sockaddr_in  *sin;
+	struct sockaddr_in6 *sin6;
+
+	(void)memset(addr, 0, sizeof(dns_addr_t));
+	sin  = (struct sockaddr_in *)&addr->sa;
+	sin6 = (struct sockaddr_in6 *)&addr->sa;
+	if (inet_pton(AF_INET, str, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		addr->len = sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, str, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		addr->len = sizeof(struct sockaddr_in6);
+	} else
+		return (false);
+	return (true);
+}
+
+/*
+ * Looks up 'host' in the cache.
+ *
+ * Returns the number of addresses, 0 for a cached lookup failure, or -1
+ * if there is no usable entry. *expired is set if the entry is stale.
+ */
+static int
+cache_lookup(const char *host, dns_addr_t *addrs, int max, bool *expired)
+{
+	int    n;
+	char   *val, *p, *q;
+	time_t expiry, now;
+
+	if ((val = cache_get(PATH_DNSCACHE, host)) == NULL)
+		return (-1);
+	expiry = (time_t)strtoll(val, &p, 10);
+	now    = time(NULL);
+	if (*p != ' ' || now > expiry + (dns_stale ? DNS_STALE_MAX : 0)) {
+		free(val); return (-1);
+	}
+	*expired = now > expiry ? true : false;
+	for (n = 0, p++; n < max && (q = strsep(&p, ",")) != NULL;) {
+		if (parse_addr(q, &addrs[n]))
+			n++;
+	}
+	free(val);
+	if (n == 0 && *expired)
+		/* Don't serve stale failures. */
+		return (-1);
+	return (n);
+}
+
+static void
+cache_store(const char *host, dns_addr_t *addrs, int n)
+{
+	int  i;
+	char *val, *p, buf[INET6_ADDRSTRLEN];
+	void *a;
+
+	if (dns_ttl < 0)
+		return;
+	if ((val = malloc(24 + n * (INET6_ADDRSTRLEN + 1))) == NULL)
+		return;
+	p = val + sprintf(val, "%lld ", (long long)time(NULL) +
+	    (n > 0 ? dns_ttl : DNS_NEG_TTL));
+	for (i = 0; i < n; i++) {
+		if (addrs[i].sa.ss_family == AF_INET6)
+			a = &((struct sockaddr_in6 *)&addrs[i].sa)->sin6_addr;
+		else
+			a = &((struct sockaddr_in *)&addrs[i].sa)->sin_addr;
+		if (inet_ntop(addrs[i].sa.ss_family, a, buf,
+		    sizeof(buf)) == NULL)
+			continue;
+		p += sprintf(p, "%s%s", p[-1] == ' ' ? "" : ",", buf);
+	}
+	if (p[-1] == ' ')
+		(void)strcpy(p, "-");
+	(void)cache_put(PATH_DNSCACHE, host, val);
+	free(val);
+}
+
+/*
+ * Resolves 'host' using the system resolver, and caches the result.
+ */
+static int
+lookup(const char *host, dns_addr_t *addrs, int max)
+{
+	int		n, error;
+	struct addrinfo hints, *res, *ai;
+
+	(void)memset(&hints, 0, sizeof(hints));
+	hints.ai_family	  = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+		if (error == EAI_NONAME)
+			cache_store(host, addrs, 0);
+		warnx("getaddrinfo(%s): %s", host, gai_strerror(error));
+		return (-1);
+	}
+	for (n = 0, ai = res; ai != NULL && n < max; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(addrs[n].sa))
+			continue;
+		(void)memset(&addrs[n], 0, sizeof(dns_addr_t));
+		(void)memcpy(&addrs[n].sa, ai->ai_addr, ai->ai_addrlen);
+		addrs[n++].len = ai->ai_addrlen;
+	}
+	freeaddrinfo(res);
+	cache_store(host, addrs, n);
+
+	return (n);
+}
+
+/*
+ * Refreshes a stale cache entry in a grandchild process, so the caller
+ * doesn't have to wait for the resolver. The child exits right away and
+ * is reaped here; the grandchild is left to init.
+ */
+static void
+refresh(const char *host)
+{
+	pid_t	   pid;
+	dns_addr_t addrs[DNS_MAX_ADDRS];
+
+	switch ((pid = fork())) {
+	case -1:
+		warn("fork()");
+		return;
+	case 0:
+		if (fork() != 0)
+			_exit(0);
+		(void)freopen("/dev/null", "w", stderr);
+		(void)lookup(host, addrs, DNS_MAX_ADDRS);
+		_exit(0);
+	}
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Resolves 'host' to at most 'max' addresses, and sets their port.
+ *
+ * Returns the number of addresses, or -1 on error.
+ */
+int
+dns_resolve(const char *host, u_short port, dns_addr_t *addrs, int max)
+{
+	int  i, n;
+	bool expired;
+
+	if (max > 0 && parse_addr(host, &addrs[0]))
+		n = 1;
+	else if (dns_ttl < 0 || (n = cache_lookup(host, addrs, max,
+	    &expired)) == -1)
+		n = lookup(host, addrs, max);
+	else if (n == 0) {
+		warnx("%s: Host not found (cached)", host);
+		return (-1);
+	} else if (expired)
+		refresh(host);
+	for (i = 0; i < n; i++)
+		set_port(&addrs[i], port);
+	return (n);
+}
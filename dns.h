@@ -0,0 +1,46 @@
+/*-
+ * Copyright (c) 2015 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DNS_H_
+# define _DNS_H_
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "types.h"
+
+#define PATH_DNSCACHE	".cliaspora.dns"
+#define DNS_TTL		300	/* Default lifetime of cached addresses. */
+#define DNS_NEG_TTL	30	/* Lifetime of cached lookup failures. */
+#define DNS_STALE_MAX	86400	/* Max. age of stale entries to use. */
+#define DNS_MAX_ADDRS	16
+
+typedef struct dns_addr_s {
+	socklen_t		len;
+	struct sockaddr_storage sa;
+} dns_addr_t;
+
+extern int  dns_ttl;
+extern bool dns_stale;
+extern int  dns_resolve(const char *, u_short, dns_addr_t *, int);
+#endif	/* !_DNS_H_ */
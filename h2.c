@@ -0,0 +1,1094 @@
+/*-
+ * Copyright (c) 2015 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+
+#include "types.h"
+#include "ssl.h"
+#include "h2.h"
+
+/*
+ * A minimal HTTP/2 client (RFC 7540) for the request engine in http.c.
+ * The connection is driven by the caller's poll(2) loop: h2_request() and
+ * h2_send_data() queue frames, h2_flush() writes them to the non-blocking
+ * socket, and h2_input() reads what the socket has and reports the events
+ * of the streams through the callbacks.
+ *
+ * Requests are sent without Huffman coding and without indexing. Server
+ * push is disabled.
+ */
+#define H2_PREFACE	 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_MAX_WINDOW	 0x7fffffffL
+#define H2_MAX_HBLOCK	 262144		/* Max. size of a header block. */
+
+#define H2_DATA		 0x0
+#define H2_HEADERS	 0x1
+#define H2_PRIORITY	 0x2
+#define H2_RST_STREAM	 0x3
+#define H2_SETTINGS	 0x4
+#define H2_PUSH_PROMISE	 0x5
+#define H2_PING		 0x6
+#define H2_GOAWAY	 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION	 0x9
+
+#define H2_F_END_STREAM	 0x01
+#define H2_F_ACK	 0x01
+#define H2_F_END_HEADERS 0x04
+#define H2_F_PADDED	 0x08
+#define H2_F_PRIORITY	 0x20
+
+#define H2_S_ENABLE_PUSH	 0x2
+#define H2_S_MAX_STREAMS	 0x3
+#define H2_S_INITIAL_WINDOW_SIZE 0x4
+#define H2_S_MAX_FRAME_SIZE	 0x5
+
+#define NSTATIC	(sizeof(hpack_static) / sizeof(hpack_static[0]))
+
+/*
+ * The canonical Huffman code of RFC 7541, Appendix B: the number of codes
+ * of each length, and the symbols ordered by code. 256 is EOS.
+ */
+static const u_char huff_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const u_short huff_sym[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+	45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+	95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+	58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+	106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+	88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+	0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+	167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+	132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+	173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+	151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+	183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+	171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+	255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+	246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+	6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+	249, 10, 13, 22, 256
+};
+
+/*
+ * The static table of RFC 7541, Appendix A. Index 1 is the first entry.
+ */
+static const struct {
+	const char *name;
+	const char *value;
+} hpack_static[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+static void
+put32(u_char *p, u_long v)
+{
+	p[0] = (v >> 24) & 0xff; p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;	 p[3] = v & 0xff;
+}
+
+static u_long
+get32(const u_char *p)
+{
+	return ((u_long)p[0] << 24 | (u_long)p[1] << 16 | (u_long)p[2] << 8 |
+	    p[3]);
+}
+
+/*
+ * Makes room for 'len' more bytes in the output buffer. The unsent data
+ * may move, which SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER allows.
+ */
+static int
+out_reserve(h2_conn_t *h2, size_t len)
+{
+	size_t sz;
+	u_char *p;
+
+	if (h2->outpos > 0) {
+		(void)memmove(h2->out, h2->out + h2->outpos,
+		    h2->outlen - h2->outpos);
+		h2->outlen -= h2->outpos;
+		h2->outpos  = 0;
+	}
+	if (h2->outlen + len <= h2->outsz)
+		return (0);
+	for (sz = h2->outsz > 0 ? h2->outsz : 16384; sz < h2->outlen + len;)
+		sz *= 2;
+	if ((p = realloc(h2->out, sz)) == NULL) {
+		warn("realloc()"); return (-1);
+	}
+	h2->out = p; h2->outsz = sz;
+
+	return (0);
+}
+
+static int
+frame_put(h2_conn_t *h2, int type, int flags, u_int id, const void *data,
+	size_t len)
+{
+	u_char *p;
+
+	if (out_reserve(h2, 9 + len) == -1)
+		return (-1);
+	p = h2->out + h2->outlen;
+	p[0] = (len >> 16) & 0xff; p[1] = (len >> 8) & 0xff; p[2] = len & 0xff;
+	p[3] = type; p[4] = flags;
+	put32(p + 5, id & H2_MAX_WINDOW);
+	if (len > 0)
+		(void)memcpy(p + 9, data, len);
+	h2->outlen += 9 + len;
+
+	return (0);
+}
+
+static h2_stream_t *
+stream_find(h2_conn_t *h2, u_int id)
+{
+	int i;
+
+	for (i = 0; id != 0 && i < H2_MAX_STREAMS; i++) {
+		if (h2->streams[i].id == id)
+			return (&h2->streams[i]);
+	}
+	return (NULL);
+}
+
+static void
+stream_close(h2_conn_t *h2, h2_stream_t *sp, u_int error)
+{
+	u_int id;
+
+	id = sp->id; sp->id = 0;
+	h2->nstreams--;
+	h2->ops->close(h2->arg, id, error);
+}
+
+/*
+ * Sends GOAWAY with the given error code. The connection can't be used
+ * anymore.
+ */
+static int
+conn_error(h2_conn_t *h2, u_int error, const char *msg)
+{
+	u_char p[8];
+
+	warnx("HTTP/2: %s", msg);
+	put32(p, 0); put32(p + 4, error);
+	if (frame_put(h2, H2_GOAWAY, 0, 0, p, sizeof(p)) == 0)
+		(void)h2_flush(h2);
+	h2->goaway = true;
+
+	return (-1);
+}
+
+/*
+ * Resets the stream 'sp' with the given error code, and closes it. The
+ * connection can still be used.
+ */
+static int
+stream_error(h2_conn_t *h2, h2_stream_t *sp, u_int error, const char *msg)
+{
+	u_char p[4];
+
+	warnx("HTTP/2: %s", msg);
+	put32(p, error);
+	if (frame_put(h2, H2_RST_STREAM, 0, sp->id, p, sizeof(p)) == -1)
+		return (-1);
+	stream_close(h2, sp, error);
+
+	return (0);
+}
+
+/*
+ * Returns the bytes received on a stream or the connection to the sender
+ * once half of the receive window is used up.
+ */
+static int
+window_update(h2_conn_t *h2, u_int id, long *unacked, long window)
+{
+	u_char p[4];
+
+	if (*unacked < window / 2)
+		return (0);
+	put32(p, *unacked); *unacked = 0;
+
+	return (frame_put(h2, H2_WINDOW_UPDATE, 0, id, p, sizeof(p)));
+}
+
+/*
+ * Decodes an HPACK integer with a 'prefix' bit prefix.
+ */
+static int
+hpack_int(const u_char **pp, const u_char *end, int prefix, u_long *val)
+{
+	int	     shift;
+	u_long	     v, max;
+	const u_char *p;
+
+	if ((p = *pp) >= end)
+		return (-1);
+	max = (1UL << prefix) - 1;
+	if ((v = *p++ & max) == max) {
+		for (shift = 0;; shift += 7) {
+			if (p >= end || shift > 21)
+				return (-1);
+			v += (u_long)(*p & 0x7f) << shift;
+			if ((*p++ & 0x80) == 0)
+				break;
+		}
+	}
+	*pp = p; *val = v;
+
+	return (0);
+}
+
+/*
+ * Decodes 'len' bytes of Huffman coded data bit by bit using the canonical
+ * code. The padding must be a prefix of EOS.
+ */
+static int
+huff_decode(const u_char *p, size_t len, char *out, size_t *outlen)
+{
+	int    b, bits, code, count, first, index, sym;
+	size_t n;
+
+	for (n = 0, bits = code = first = index = 0; len > 0; p++, len--) {
+		for (b = 7; b >= 0; b--) {
+			code |= (*p >> b) & 1;
+			count = huff_count[++bits];
+			if (code < first + count) {
+				if ((sym = huff_sym[index + code - first]) == 256)
+					return (-1);
+				out[n++] = (char)sym;
+				bits = code = first = index = 0;
+				continue;
+			}
+			if (bits == 30)
+				return (-1);
+			index += count; first += count;
+			first <<= 1; code <<= 1;
+		}
+	}
+	if (bits > 7 || code >> 1 != (1 << bits) - 1)
+		return (-1);
+	*outlen = n;
+
+	return (0);
+}
+
+/*
+ * Decodes an HPACK string literal into a new buffer.
+ */
+static char *
+hpack_str(const u_char **pp, const u_char *end, size_t *len)
+{
+	bool	     huff;
+	char	     *s;
+	u_long	     n;
+	const u_char *p;
+
+	if (*pp >= end)
+		return (NULL);
+	huff = (**pp & 0x80) != 0;
+	if (hpack_int(pp, end, 7, &n) == -1 || n > (u_long)(end - *pp))
+		return (NULL);
+	p = *pp; *pp += n;
+	if ((s = malloc(huff ? n * 8 / 5 + 1 : n + 1)) == NULL) {
+		warn("malloc()"); return (NULL);
+	}
+	if (!huff) {
+		(void)memcpy(s, p, n); *len = n;
+	} else if (huff_decode(p, n, s, len) == -1) {
+		free(s); return (NULL);
+	}
+	s[*len] = '\0';
+
+	return (s);
+}
+
+/*
+ * Removes the oldest entries from the dynamic table until its size is
+ * at most 'max'.
+ */
+static void
+table_evict(h2_conn_t *h2, size_t max)
+{
+	h2_hent_t *e;
+
+	while (h2->tsize > max) {
+		e = &h2->table[--h2->ntable];
+		h2->tsize -= e->size;
+		free(e->name); free(e->value);
+	}
+}
+
+/*
+ * Adds a field to the dynamic table, which takes over name and value.
+ */
+static void
+table_add(h2_conn_t *h2, char *name, size_t nlen, char *value, size_t vlen)
+{
+	size_t size;
+
+	size = nlen + vlen + 32;
+	if (size > h2->tmax) {
+		table_evict(h2, 0);
+		free(name); free(value);
+		return;
+	}
+	table_evict(h2, h2->tmax - size);
+	(void)memmove(h2->table + 1, h2->table, h2->ntable * sizeof(h2_hent_t));
+	h2->table[0].name  = name;
+	h2->table[0].value = value;
+	h2->table[0].size  = size;
+	h2->ntable++;
+	h2->tsize += size;
+}
+
+static int
+table_get(h2_conn_t *h2, u_long idx, const char **name, const char **value)
+{
+	if (idx == 0)
+		return (-1);
+	if (idx <= NSTATIC) {
+		*name  = hpack_static[idx - 1].name;
+		*value = hpack_static[idx - 1].value;
+		return (0);
+	}
+	if ((idx -= NSTATIC + 1) >= (u_long)h2->ntable)
+		return (-1);
+	*name  = h2->table[idx].name;
+	*value = h2->table[idx].value;
+
+	return (0);
+}
+
+static void
+hpack_emit(h2_conn_t *h2, u_int id, const char *name, const char *value)
+{
+	if (stream_find(h2, id) != NULL)
+		h2->ops->header(h2->arg, id, name, value);
+}
+
+/*
+ * Decodes a header block, and passes the fields to the header callback.
+ * Blocks of closed streams must be decoded as well to keep the dynamic
+ * table in sync.
+ */
+static int
+hpack_decode(h2_conn_t *h2, u_int id, const u_char *p, size_t len)
+{
+	bool	     add;
+	char	     *name, *value;
+	u_long	     idx;
+	size_t	     nlen, vlen;
+	const char   *n, *v;
+	const u_char *end;
+
+	for (end = p + len; p < end;) {
+		if (*p & 0x80) {
+			/* Indexed field */
+			if (hpack_int(&p, end, 7, &idx) == -1 ||
+			    table_get(h2, idx, &n, &v) == -1)
+				return (-1);
+			hpack_emit(h2, id, n, v);
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) {
+			/* Dynamic table size update */
+			if (hpack_int(&p, end, 5, &idx) == -1 ||
+			    idx > H2_TABLE_SIZE)
+				return (-1);
+			table_evict(h2, h2->tmax = idx);
+			continue;
+		}
+		/* Literal with or without indexing, or never indexed */
+		add = (*p & 0x40) != 0;
+		if (hpack_int(&p, end, add ? 6 : 4, &idx) == -1)
+			return (-1);
+		if (idx == 0)
+			name = hpack_str(&p, end, &nlen);
+		else if (table_get(h2, idx, &n, &v) == -1)
+			return (-1);
+		else if ((name = strdup(n)) == NULL)
+			warn("strdup()");
+		else
+			nlen = strlen(name);
+		if (name == NULL || (value = hpack_str(&p, end, &vlen)) == NULL) {
+			free(name); return (-1);
+		}
+		hpack_emit(h2, id, name, value);
+		if (add)
+			table_add(h2, name, nlen, value, vlen);
+		else {
+			free(name); free(value);
+		}
+	}
+	return (0);
+}
+
+static u_char *
+hpack_int_put(u_char *p, int flags, int prefix, u_long v)
+{
+	u_long max;
+
+	max = (1UL << prefix) - 1;
+	if (v < max) {
+		*p++ = flags | v;
+		return (p);
+	}
+	*p++ = flags | max;
+	for (v -= max; v >= 0x80; v >>= 7)
+		*p++ = (v & 0x7f) | 0x80;
+	*p++ = v;
+
+	return (p);
+}
+
+static u_char *
+hpack_str_put(u_char *p, const char *s)
+{
+	size_t len;
+
+	len = strlen(s);
+	p = hpack_int_put(p, 0, 7, len);
+	(void)memcpy(p, s, len);
+
+	return (p + len);
+}
+
+/*
+ * Encodes a field as an index into the static table if possible, and as
+ * a literal without indexing otherwise.
+ */
+static u_char *
+hpack_field_put(u_char *p, const char *name, const char *value)
+{
+	u_int i, idx;
+
+	for (i = idx = 0; i < NSTATIC; i++) {
+		if (strcmp(hpack_static[i].name, name) != 0)
+			continue;
+		if (strcmp(hpack_static[i].value, value) == 0)
+			return (hpack_int_put(p, 0x80, 7, i + 1));
+		if (idx == 0)
+			idx = i + 1;
+	}
+	p = hpack_int_put(p, 0, 4, idx);
+	if (idx == 0)
+		p = hpack_str_put(p, name);
+	return (hpack_str_put(p, value));
+}
+
+static int
+frame_data(h2_conn_t *h2, int flags, u_int id, const u_char *p, size_t len)
+{
+	long	    n;
+	h2_stream_t *sp;
+
+	if (id == 0)
+		return (conn_error(h2, H2_PROTOCOL_ERROR, "DATA on stream 0"));
+	n = (long)len;
+	if (flags & H2_F_PADDED) {
+		if (len < 1 || p[0] >= len)
+			return (conn_error(h2, H2_PROTOCOL_ERROR,
+			    "Invalid padding"));
+		len -= 1 + p[0]; p++;
+	}
+	h2->unacked += n;
+	if (window_update(h2, 0, &h2->unacked, H2_CONN_WINDOW) == -1)
+		return (-1);
+	if ((sp = stream_find(h2, id)) == NULL)
+		return (0);
+	sp->unacked += n;
+	if (len > 0)
+		h2->ops->data(h2->arg, id, (const char *)p, len);
+	if ((sp = stream_find(h2, id)) == NULL)
+		return (0);
+	if (flags & H2_F_END_STREAM) {
+		stream_close(h2, sp, H2_NO_ERROR);
+		return (0);
+	}
+	return (window_update(h2, id, &sp->unacked, H2_STREAM_WINDOW));
+}
+
+/*
+ * Collects the fragments of a header block from a HEADERS frame and its
+ * CONTINUATION frames, and decodes the block when it's complete.
+ */
+static int
+frame_headers(h2_conn_t *h2, int type, int flags, u_int id, const u_char *p,
+	size_t len)
+{
+	size_t	    pad, sz;
+	u_char	    *b;
+	h2_stream_t *sp;
+
+	if (type == H2_HEADERS) {
+		if (id == 0) {
+			return (conn_error(h2, H2_PROTOCOL_ERROR,
+			    "HEADERS on stream 0"));
+		}
+		pad = 0;
+		if (flags & H2_F_PADDED) {
+			if (len < 1)
+				return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+				    "Invalid HEADERS frame"));
+			pad = *p++; len--;
+		}
+		if (flags & H2_F_PRIORITY) {
+			if (len < 5)
+				return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+				    "Invalid HEADERS frame"));
+			p += 5; len -= 5;
+		}
+		if (pad > len)
+			return (conn_error(h2, H2_PROTOCOL_ERROR,
+			    "Invalid padding"));
+		len -= pad;
+		h2->hbid  = id;
+		h2->hbend = (flags & H2_F_END_STREAM) != 0;
+		h2->hblen = 0;
+	} else if (id != h2->hbid || id == 0)
+		return (conn_error(h2, H2_PROTOCOL_ERROR,
+		    "Unexpected CONTINUATION"));
+	if (h2->hblen + len > H2_MAX_HBLOCK)
+		return (conn_error(h2, H2_INTERNAL_ERROR,
+		    "Header block too large"));
+	if (h2->hblen + len > h2->hbsz) {
+		for (sz = h2->hbsz > 0 ? h2->hbsz : 4096; sz < h2->hblen + len;)
+			sz *= 2;
+		if ((b = realloc(h2->hblock, sz)) == NULL) {
+			warn("realloc()"); return (-1);
+		}
+		h2->hblock = b; h2->hbsz = sz;
+	}
+	(void)memcpy(h2->hblock + h2->hblen, p, len);
+	h2->hblen += len;
+	if ((flags & H2_F_END_HEADERS) == 0)
+		return (0);
+	h2->hbid = 0;
+	if (hpack_decode(h2, id, h2->hblock, h2->hblen) == -1)
+		return (conn_error(h2, H2_COMPRESSION_ERROR,
+		    "Invalid header block"));
+	if (stream_find(h2, id) == NULL)
+		return (0);
+	h2->ops->headers_end(h2->arg, id);
+	if (h2->hbend && (sp = stream_find(h2, id)) != NULL)
+		stream_close(h2, sp, H2_NO_ERROR);
+	return (0);
+}
+
+static int
+frame_settings(h2_conn_t *h2, int flags, u_int id, const u_char *p,
+	size_t len)
+{
+	int    i;
+	u_long v;
+
+	if (id != 0)
+		return (conn_error(h2, H2_PROTOCOL_ERROR, "Invalid SETTINGS"));
+	if (flags & H2_F_ACK) {
+		if (len != 0)
+			return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+			    "Invalid SETTINGS"));
+		return (0);
+	}
+	if (len % 6 != 0)
+		return (conn_error(h2, H2_FRAME_SIZE_ERROR, "Invalid SETTINGS"));
+	for (; len > 0; p += 6, len -= 6) {
+		v = get32(p + 2);
+		switch (p[0] << 8 | p[1]) {
+		case H2_S_MAX_STREAMS:
+			h2->max_streams = v;
+			break;
+		case H2_S_INITIAL_WINDOW_SIZE:
+			if (v > H2_MAX_WINDOW)
+				return (conn_error(h2, H2_FLOW_CONTROL_ERROR,
+				    "Invalid window size"));
+			for (i = 0; i < H2_MAX_STREAMS; i++)
+				h2->streams[i].swindow += (long)v - h2->init_window;
+			h2->init_window = (long)v;
+			break;
+		case H2_S_MAX_FRAME_SIZE:
+			if (v < 16384 || v > 16777215)
+				return (conn_error(h2, H2_PROTOCOL_ERROR,
+				    "Invalid frame size"));
+			h2->max_frame = v;
+			break;
+		}
+	}
+	return (frame_put(h2, H2_SETTINGS, H2_F_ACK, 0, NULL, 0));
+}
+
+static int
+frame_goaway(h2_conn_t *h2, const u_char *p, size_t len)
+{
+	int    i;
+	u_long error;
+
+	if (len < 8)
+		return (conn_error(h2, H2_FRAME_SIZE_ERROR, "Invalid GOAWAY"));
+	h2->goaway  = true;
+	h2->last_id = get32(p) & H2_MAX_WINDOW;
+	if ((error = get32(p + 4)) != H2_NO_ERROR)
+		warnx("HTTP/2: Connection closed by %s (error %lu)",
+		    h2->cp->host, error);
+	/* The server didn't process the later streams. */
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (h2->streams[i].id > h2->last_id)
+			stream_close(h2, &h2->streams[i], H2_REFUSED_STREAM);
+	}
+	return (0);
+}
+
+static int
+frame_window_update(h2_conn_t *h2, u_int id, const u_char *p, size_t len)
+{
+	long	    inc;
+	h2_stream_t *sp;
+
+	if (len != 4)
+		return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+		    "Invalid WINDOW_UPDATE"));
+	inc = (long)(get32(p) & H2_MAX_WINDOW);
+	if (id == 0) {
+		if (inc == 0)
+			return (conn_error(h2, H2_PROTOCOL_ERROR,
+			    "Invalid WINDOW_UPDATE"));
+		if ((h2->swindow += inc) > H2_MAX_WINDOW)
+			return (conn_error(h2, H2_FLOW_CONTROL_ERROR,
+			    "Window too large"));
+	} else if ((sp = stream_find(h2, id)) != NULL) {
+		/* Only the stream is in error (RFC 7540, 6.9). */
+		if (inc == 0)
+			return (stream_error(h2, sp, H2_PROTOCOL_ERROR,
+			    "Invalid WINDOW_UPDATE"));
+		if ((sp->swindow += inc) > H2_MAX_WINDOW)
+			return (stream_error(h2, sp, H2_FLOW_CONTROL_ERROR,
+			    "Stream window too large"));
+	}
+	return (0);
+}
+
+static int
+frame(h2_conn_t *h2, const u_char *p, size_t len)
+{
+	int	    type, flags;
+	u_int	    id;
+	h2_stream_t *sp;
+
+	type  = p[3];
+	flags = p[4];
+	id    = get32(p + 5) & H2_MAX_WINDOW;
+	p    += 9;
+	if (h2->hbid != 0 && type != H2_CONTINUATION)
+		return (conn_error(h2, H2_PROTOCOL_ERROR,
+		    "Expected CONTINUATION"));
+	switch (type) {
+	case H2_DATA:
+		return (frame_data(h2, flags, id, p, len));
+	case H2_HEADERS:
+	case H2_CONTINUATION:
+		return (frame_headers(h2, type, flags, id, p, len));
+	case H2_SETTINGS:
+		return (frame_settings(h2, flags, id, p, len));
+	case H2_RST_STREAM:
+		if (id == 0)
+			return (conn_error(h2, H2_PROTOCOL_ERROR,
+			    "Invalid RST_STREAM"));
+		if (len != 4)
+			return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+			    "Invalid RST_STREAM"));
+		if ((sp = stream_find(h2, id)) != NULL)
+			stream_close(h2, sp, (u_int)get32(p));
+		return (0);
+	case H2_PING:
+		if (id != 0)
+			return (conn_error(h2, H2_PROTOCOL_ERROR,
+			    "Invalid PING"));
+		if (len != 8)
+			return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+			    "Invalid PING"));
+		if (flags & H2_F_ACK)
+			return (0);
+		return (frame_put(h2, H2_PING, H2_F_ACK, 0, p, len));
+	case H2_GOAWAY:
+		return (frame_goaway(h2, p, len));
+	case H2_WINDOW_UPDATE:
+		return (frame_window_update(h2, id, p, len));
+	case H2_PUSH_PROMISE:
+		return (conn_error(h2, H2_PROTOCOL_ERROR,
+		    "Unexpected PUSH_PROMISE"));
+	}
+	/* PRIORITY and unknown frames are ignored. */
+	return (0);
+}
+
+/*
+ * Starts a new stream with the given request header. If 'end' is set, the
+ * request has no body. Otherwise h2_send_data() sends it.
+ *
+ * Returns the ID of the stream, and -1 on error, in which case the
+ * connection can't be used anymore.
+ */
+int
+h2_request(h2_conn_t *h2, const h2_field_t *fields, int nfields, bool end)
+{
+	int	    i, type, flags;
+	u_int	    id;
+	size_t	    len, n;
+	u_char	    *block, *p;
+	h2_stream_t *sp;
+
+	if (!h2_can_open(h2))
+		return (-1);
+	for (sp = h2->streams; sp->id != 0; sp++)
+		;
+	for (i = 0, len = 0; i < nfields; i++)
+		len += strlen(fields[i].name) + strlen(fields[i].value) + 12;
+	if ((block = malloc(len)) == NULL) {
+		warn("malloc()"); return (-1);
+	}
+	for (i = 0, p = block; i < nfields; i++)
+		p = hpack_field_put(p, fields[i].name, fields[i].value);
+	id    = h2->next_id;
+	len   = p - block;
+	type  = H2_HEADERS;
+	flags = end ? H2_F_END_STREAM : 0;
+	for (p = block;; p += n, len -= n) {
+		if ((n = len) <= h2->max_frame)
+			flags |= H2_F_END_HEADERS;
+		else
+			n = h2->max_frame;
+		if (frame_put(h2, type, flags, id, p, n) == -1) {
+			free(block); return (-1);
+		}
+		if (n == len)
+			break;
+		type = H2_CONTINUATION; flags = 0;
+	}
+	free(block);
+	sp->id	     = id;
+	sp->swindow  = h2->init_window;
+	sp->unacked  = 0;
+	h2->next_id += 2;
+	h2->nstreams++;
+
+	return ((int)id);
+}
+
+/*
+ * Returns true if h2_request() can start another stream.
+ */
+bool
+h2_can_open(h2_conn_t *h2)
+{
+	return (!h2->goaway && h2->nstreams < H2_MAX_STREAMS &&
+	    (u_int)h2->nstreams < h2->max_streams &&
+	    h2->next_id < H2_MAX_WINDOW);
+}
+
+/*
+ * Queues as much of the 'len' bytes of request body as the flow control
+ * windows allow. If 'end' is set, the last frame ends the stream.
+ *
+ * Returns the number of bytes queued, and -1 if the stream is closed or
+ * on error.
+ */
+long
+h2_send_data(h2_conn_t *h2, u_int id, const char *p, size_t len, bool end)
+{
+	long	    n;
+	h2_stream_t *sp;
+
+	if ((sp = stream_find(h2, id)) == NULL)
+		return (-1);
+	if (h2->outlen - h2->outpos > H2_OUTBUF_HIGH)
+		return (0);
+	n = len > h2->max_frame ? (long)h2->max_frame : (long)len;
+	if (n > sp->swindow)
+		n = sp->swindow;
+	if (n > h2->swindow)
+		n = h2->swindow;
+	if (n <= 0 && (len > 0 || !end))
+		return (0);
+	if (frame_put(h2, H2_DATA, end && (size_t)n == len ? H2_F_END_STREAM :
+	    0, id, p, n) == -1)
+		return (-1);
+	sp->swindow -= n;
+	h2->swindow -= n;
+
+	return (n);
+}
+
+/*
+ * Resets a stream the caller isn't interested in anymore. The close
+ * callback isn't called.
+ */
+void
+h2_cancel(h2_conn_t *h2, u_int id)
+{
+	u_char	    p[4];
+	h2_stream_t *sp;
+
+	if ((sp = stream_find(h2, id)) == NULL)
+		return;
+	put32(p, H2_CANCEL);
+	(void)frame_put(h2, H2_RST_STREAM, 0, id, p, sizeof(p));
+	sp->id = 0;
+	h2->nstreams--;
+}
+
+/*
+ * Writes the queued frames.
+ *
+ * Returns 0 if all was written, 1 if the socket isn't ready, and -1 on
+ * error.
+ */
+int
+h2_flush(h2_conn_t *h2)
+{
+	int n;
+
+	while (h2->outpos < h2->outlen) {
+		/* A retried SSL_write() needs the same length. */
+		if (h2->wlen == 0) {
+			h2->wlen = h2->outlen - h2->outpos > SSL_RECORD_SIZE ?
+			    SSL_RECORD_SIZE : (int)(h2->outlen - h2->outpos);
+		}
+		n = SSL_write(h2->cp->handle, h2->out + h2->outpos, h2->wlen);
+		if (n <= 0) {
+			if ((h2->wevents = ssl_events(h2->cp, n)) == -1)
+				return (-1);
+			return (1);
+		}
+		h2->outpos += n;
+		h2->wlen    = 0;
+	}
+	h2->outpos = h2->outlen = 0;
+	h2->wevents = 0;
+
+	return (0);
+}
+
+/*
+ * Reads and processes the frames that arrived.
+ *
+ * Returns 0 if the socket has no more data, and -1 if the connection was
+ * closed or on error.
+ */
+int
+h2_input(h2_conn_t *h2)
+{
+	int    n;
+	size_t len, off;
+
+	for (h2->revents = 0;;) {
+		for (off = 0; h2->inlen - off >= 9; off += 9 + len) {
+			len = (size_t)h2->in[off] << 16 |
+			    (size_t)h2->in[off + 1] << 8 | h2->in[off + 2];
+			if (len > H2_FRAME_SIZE)
+				return (conn_error(h2, H2_FRAME_SIZE_ERROR,
+				    "Frame too large"));
+			if (h2->inlen - off < 9 + len)
+				break;
+			if (frame(h2, h2->in + off, len) == -1)
+				return (-1);
+		}
+		if (off > 0) {
+			h2->inlen -= off;
+			(void)memmove(h2->in, h2->in + off, h2->inlen);
+		}
+		n = SSL_read(h2->cp->handle, h2->in + h2->inlen,
+		    sizeof(h2->in) - h2->inlen);
+		if (n <= 0) {
+			if ((n = ssl_events(h2->cp, n)) == -1)
+				return (-1);
+			if (n == POLLOUT)
+				h2->revents = POLLOUT;
+			return (0);
+		}
+		h2->inlen += n;
+	}
+}
+
+/*
+ * Returns the poll(2) events the connection waits for.
+ */
+int
+h2_events(h2_conn_t *h2)
+{
+	int events;
+
+	events = POLLIN | h2->revents;
+	if (h2->outpos < h2->outlen)
+		events |= h2->wevents != 0 ? h2->wevents : POLLOUT;
+	return (events);
+}
+
+/*
+ * Starts HTTP/2 on a connection whose handshake selected "h2" by ALPN.
+ * The preface and our settings are queued for the next h2_flush().
+ */
+h2_conn_t *
+h2_new(ssl_conn_t *cp)
+{
+	u_char	  p[12];
+	h2_conn_t *h2;
+
+	if ((h2 = calloc(1, sizeof(h2_conn_t))) == NULL) {
+		warn("calloc()"); return (NULL);
+	}
+	if ((h2->table = calloc(H2_TABLE_SIZE / 32,
+	    sizeof(h2_hent_t))) == NULL) {
+		warn("calloc()"); free(h2); return (NULL);
+	}
+	h2->cp		= cp;
+	h2->next_id	= 1;
+	h2->max_streams = H2_MAX_STREAMS;
+	h2->max_frame	= 16384;
+	h2->init_window = h2->swindow = 65535;
+	h2->tmax	= H2_TABLE_SIZE;
+	(void)SSL_set_mode(cp->handle, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	p[0] = 0; p[1] = H2_S_ENABLE_PUSH; put32(p + 2, 0);
+	p[6] = 0; p[7] = H2_S_INITIAL_WINDOW_SIZE;
+	put32(p + 8, H2_STREAM_WINDOW);
+	if (ssl_set_nonblock(cp, true) == -1 ||
+	    out_reserve(h2, sizeof(H2_PREFACE) - 1) == -1)
+		goto error;
+	(void)memcpy(h2->out, H2_PREFACE, sizeof(H2_PREFACE) - 1);
+	h2->outlen = sizeof(H2_PREFACE) - 1;
+	if (frame_put(h2, H2_SETTINGS, 0, 0, p, sizeof(p)) == -1)
+		goto error;
+	put32(p, H2_CONN_WINDOW - 65535);
+	if (frame_put(h2, H2_WINDOW_UPDATE, 0, 0, p, 4) == -1)
+		goto error;
+	return (h2);
+error:
+	free(h2->out); free(h2->table); free(h2);
+
+	return (NULL);
+}
+
+/*
+ * Closes the connection politely and frees it.
+ */
+void
+h2_free(h2_conn_t *h2)
+{
+	u_char p[8];
+
+	if (h2 == NULL)
+		return;
+	if (!h2->goaway) {
+		put32(p, 0); put32(p + 4, H2_NO_ERROR);
+		if (frame_put(h2, H2_GOAWAY, 0, 0, p, sizeof(p)) == 0)
+			(void)h2_flush(h2);
+	}
+	table_evict(h2, 0);
+	free(h2->table); free(h2->hblock); free(h2->out);
+	ssl_disconnect(h2->cp);
+	free(h2);
+}
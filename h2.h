@@ -0,0 +1,121 @@
+/*-
+ * Copyright (c) 2015 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _H2_H_
+# define _H2_H_
+
+#define H2_MAX_STREAMS	    32		/* Max. streams we open at once. */
+#define H2_FRAME_SIZE	    16384	/* Max. frame payload we accept. */
+#define H2_TABLE_SIZE	    4096	/* Size of the HPACK dynamic table. */
+#define H2_STREAM_WINDOW    1048576	/* Receive window of a stream. */
+#define H2_CONN_WINDOW	    16777216	/* Receive window of the connection. */
+#define H2_OUTBUF_HIGH	    65536	/* Max. queued output for DATA. */
+
+/*
+ * Error codes of RST_STREAM and GOAWAY frames.
+ */
+#define H2_NO_ERROR	    0x0
+#define H2_PROTOCOL_ERROR   0x1
+#define H2_INTERNAL_ERROR   0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM   0x7
+#define H2_CANCEL	    0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+/*
+ * A header field of a request. Names must be lower case.
+ */
+typedef struct h2_field_s {
+	const char *name;
+	const char *value;
+} h2_field_t;
+
+/*
+ * Callbacks for the events of a stream. 'header' is called for each field
+ * of a header block, and 'headers_end' after the block. 'close' is called
+ * once when the stream ends, right after 'headers_end' if the block ends
+ * it, with H2_NO_ERROR if the reply is complete. The callbacks may call
+ * h2_cancel().
+ */
+typedef struct h2_ops_s {
+	void (*header)(void *, u_int, const char *, const char *);
+	void (*headers_end)(void *, u_int);
+	void (*data)(void *, u_int, const char *, size_t);
+	void (*close)(void *, u_int, u_int);
+} h2_ops_t;
+
+typedef struct h2_stream_s {
+	u_int id;		/* 0 if unused */
+	long  swindow;		/* Bytes we may send */
+	long  unacked;		/* Bytes received since the last update */
+} h2_stream_t;
+
+typedef struct h2_hent_s {
+	char   *name;
+	char   *value;
+	size_t size;		/* Size as defined by RFC 7541 */
+} h2_hent_t;
+
+typedef struct h2_conn_s {
+	int	    nstreams;
+	int	    wlen;		/* Length of a pending SSL_write() */
+	int	    wevents;		/* Events a pending SSL_write() needs */
+	int	    revents;		/* Extra events SSL_read() needs */
+	bool	    goaway;		/* No new streams allowed */
+	u_int	    next_id;		/* ID of the next stream */
+	u_int	    last_id;		/* Last stream processed after GOAWAY */
+	u_int	    max_streams;	/* Peer's concurrency limit */
+	u_int	    max_frame;		/* Peer's max. frame size */
+	long	    init_window;	/* Peer's initial stream window */
+	long	    swindow;		/* Connection send window */
+	long	    unacked;		/* Bytes received since the last update */
+	h2_stream_t streams[H2_MAX_STREAMS];
+	u_char	    *out;		/* Frames to send */
+	size_t	    outsz, outlen, outpos;
+	u_char	    in[9 + H2_FRAME_SIZE]; /* Frame being received */
+	size_t	    inlen;
+	u_char	    *hblock;		/* Header block being received */
+	size_t	    hbsz, hblen;
+	u_int	    hbid;		/* Stream of hblock, or 0 */
+	bool	    hbend;		/* Stream ends with the header block */
+	h2_hent_t   *table;		/* HPACK dynamic table, newest first */
+	int	    ntable;
+	size_t	    tsize, tmax;
+	const h2_ops_t *ops;
+	void	    *arg;		/* Argument for the callbacks */
+	ssl_conn_t  *cp;
+} h2_conn_t;
+
+extern int  h2_request(h2_conn_t *, const h2_field_t *, int, bool);
+extern int  h2_flush(h2_conn_t *);
+extern int  h2_input(h2_conn_t *);
+extern int  h2_events(h2_conn_t *);
+extern bool h2_can_open(h2_conn_t *);
+extern long h2_send_data(h2_conn_t *, u_int, const char *, size_t, bool);
+extern void h2_cancel(h2_conn_t *, u_int);
+extern void h2_free(h2_conn_t *);
+extern h2_conn_t *h2_new(ssl_conn_t *);
+
+#endif /* !_H2_H_ */
@@ -26,36 +26,76 @@
 # define _GNU_SOURCE
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 #include <err.h>
+#include <zlib.h>
 
 #include "types.h"
 #include "ssl.h"
 #include "http.h"
-#include "str.h"
-
-#define HTTP_TMPL_POST_RQ	"POST %s HTTP/1.0\r\n"
-#define HTTP_TMPL_GET_RQ	"GET %s HTTP/1.0\r\n"
-#define HTTP_TMPL_DELETE_RQ	"DELETE %s HTTP/1.0\r\n"
-#define HTTP_TMPL_COOKIE	"Cookie: %s\r\n"
-#define HTTP_TMPL_CONTENT_TYPE	"Content-Type: %s\r\n"
-#define HTTP_TMPL_CONTENT_LEN	"Content-Length: %d\r\n"
-#define HTTP_TMPL_USER_AGENT	"User-Agent: %s\r\n"
-#define HTTP_TMPL_HOST	  	"Host: %s\r\n"
-#define HTTP_TMPL_ACCEPT	"Accept: %s\r\n"
-#define HTTP_TMPL_LOCATION	"Location: %s\r\n"
-#define HTTP_TMPL_CHARSET	"Charset: %s\r\n"
+#include "h2.h"
+#include "cache.h"
+#include "dns.h"
+
+#define HTTP_VERSION		" HTTP/1.1\r\n"
+#define HTTP_HDR_COOKIE		"Cookie: "
+#define HTTP_HDR_CONTENT_TYPE	"Content-Type: "
+#define HTTP_HDR_CONTENT_LEN	"Content-Length: "
+#define HTTP_HDR_USER_AGENT	"User-Agent: "
+#define HTTP_HDR_HOST		"Host: "
+#define HTTP_HDR_ACCEPT		"Accept: "
+#define HTTP_HDR_LOCATION	"Location: "
+#define HTTP_HDR_CHARSET	"Charset: "
+#define HTTP_HDR_IF_NONE_MATCH	"If-None-Match: "
+#define HTTP_HDR_IF_MOD_SINCE	"If-Modified-Since: "
+#define HTTP_XHR		"X-Requested-With: XMLHttpRequest\r\n"
+#define HTTP_KEEPALIVE		"Connection: keep-alive\r\n"
+#define HTTP_ACCEPT_ENCODING	"Accept-Encoding: gzip, deflate\r\n"
+#define HTTP_NO_CACHE		"Cache-Control: no-cache\r\n"
+#define HTTP_EXPECT		"Expect: 100-continue\r\n"
+#define HTTP_RQ_PIECES		40	/* Max. pieces of a request */
+#define HTTP_ZBUF_SIZE		16384	/* Input buffer for inflate() */
+
+bool http_cache	  = true;	/* Use the document cache for GET requests. */
+bool http_offline = false;	/* Answer GET requests from the cache only. */
+bool http_h2	  = false;	/* Run batches over HTTP/2 if possible. */
+int  http_max_age = -1;		/* Max. age of cached documents, or -1 */
+
+/*
+ * Max. age of cached documents per URL prefix. Only these documents are
+ * cached; http_max_age, if not -1, overrides their max. age.
+ */
+const http_ttl_t *http_ttls = NULL;
+
+/*
+ * State of the body decoder: chunked -> inflate -> caller.
+ */
+typedef struct http_decoder_s {
+	bool	       chunked;
+	bool	       inflate;
+	bool	       zend;	/* End of the compressed stream reached */
+	char	       *zin;	/* Input buffer for inflate() */
+	size_t	       zinsz;
+	z_stream       z;
+	http_chunked_t ch;
+} http_decoder_t;
 
 typedef struct http_req_s {
 	int cl;			/* Content length */
+	bool expect;		/* Wait for 100 Continue before the body. */
 	int type;		/* GET, POST, DELETE */
-#define HTTP_RQ_TYPE_GET    1
-#define HTTP_RQ_TYPE_POST   2
-#define HTTP_RQ_TYPE_DELETE 3
 	const char *url;
 	const char *ua;		/* User agent */
 	const char *cs;		/* Charset */
@@ -64,247 +104,3066 @@ typedef struct http_req_s {
 	const char *host;
 	const char *location;
 	const char *cookie;
+	const char *etag;	/* Validators of a cached document */
+	const char *lastmod;
+	const char *body;	/* Body to send along with the header. */
 } http_req_t;
 
-char *
-http_gen_req(http_req_t *r)
+/*
+ * Serializes the request line, the header and the optional body of 'r' in
+ * one pass. The pieces of the request are collected first, so the request
+ * can be copied into a buffer of the exact size. The length of the
+ * request is stored in 'len'.
+ *
+ * Returns the request, or NULL on error.
+ */
+static char *
+http_gen_req(http_req_t *r, size_t *len)
 {
-	int    i, lc;
-	char   *rq, *ln[16];
-	size_t rqsz;
+	int	   i, n;
+	char	   *rq, *p, cl[24];
+	size_t	   sz;
+	struct {
+		const char *s;
+		size_t	   len;
+	} pc[HTTP_RQ_PIECES];
 
-	rq = NULL; rqsz = 0; lc = 0;
+#define PIECE(str, l) do { pc[n].s = (str); pc[n++].len = (l); } while (0)
+#define LIT(str)      PIECE(str, sizeof(str) - 1)
+#define STR(str)      PIECE(str, strlen(str))
+#define FIELD(name, val) do {	\
+	LIT(name); STR(val); LIT("\r\n"); \
+} while (0)
+	n = 0;
 	switch (r->type) {
 	case HTTP_RQ_TYPE_GET:
-		ln[lc++] = strduprintf(HTTP_TMPL_GET_RQ, r->url);
-		ln[lc++] = strduprintf("X-Requested-With: XMLHttpRequest\r\n");
+		LIT("GET "); STR(r->url); LIT(HTTP_VERSION);
+		LIT(HTTP_XHR);
 		break;
 	case HTTP_RQ_TYPE_POST:
-		ln[lc++] = strduprintf(HTTP_TMPL_POST_RQ, r->url);
-		if (r->cl > 0)
-			ln[lc++] = strduprintf(HTTP_TMPL_CONTENT_LEN, r->cl);
+		LIT("POST "); STR(r->url); LIT(HTTP_VERSION);
+		/* Even an empty body needs a length. */
+		(void)snprintf(cl, sizeof(cl), "%d", r->cl);
+		FIELD(HTTP_HDR_CONTENT_LEN, cl);
+		if (r->expect)
+			LIT(HTTP_EXPECT);
 		break;
 	case HTTP_RQ_TYPE_DELETE:
-		ln[lc++] = strduprintf(HTTP_TMPL_DELETE_RQ, r->url);
+		LIT("DELETE "); STR(r->url); LIT(HTTP_VERSION);
 		break;
 	default:
 		warnx("http_gen_req(): Invalid request type: %d", r->type);
 		return (NULL);
 	}
 	if (r->host != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_HOST, r->host);
+		FIELD(HTTP_HDR_HOST, r->host);
 	if (r->location != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_LOCATION, r->location);
+		FIELD(HTTP_HDR_LOCATION, r->location);
 	if (r->cookie != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_COOKIE, r->cookie);
+		FIELD(HTTP_HDR_COOKIE, r->cookie);
 	if (r->ua != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_USER_AGENT, r->ua);
-	if (r->cs != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_CHARSET, r->cs);
-	else
-		ln[lc++] = strduprintf(HTTP_TMPL_CHARSET, "UTF-8");
+		FIELD(HTTP_HDR_USER_AGENT, r->ua);
+	FIELD(HTTP_HDR_CHARSET, r->cs != NULL ? r->cs : "UTF-8");
 	if (r->ct != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_CONTENT_TYPE, r->ct);
+		FIELD(HTTP_HDR_CONTENT_TYPE, r->ct);
 	if (r->accept != NULL)
-		ln[lc++] = strduprintf(HTTP_TMPL_ACCEPT, r->accept);
-	ln[lc++] = strduprintf("Cache-Control: no-cache\r\n\r\n");
-	for (i = 0; i < lc; i++) {
-		if (ln[i] == NULL)
-			goto error;
-		if (strdupstrcat(&rq, &rqsz, ln[i], strlen(ln[i])) == NULL)
-			goto error;
-		free(ln[i]); ln[i] = NULL;
+		FIELD(HTTP_HDR_ACCEPT, r->accept);
+	if (r->etag != NULL)
+		FIELD(HTTP_HDR_IF_NONE_MATCH, r->etag);
+	if (r->lastmod != NULL)
+		FIELD(HTTP_HDR_IF_MOD_SINCE, r->lastmod);
+	LIT(HTTP_ACCEPT_ENCODING);
+	LIT(HTTP_KEEPALIVE);
+	LIT(HTTP_NO_CACHE);
+	LIT("\r\n");
+	if (r->body != NULL && r->cl > 0)
+		PIECE(r->body, (size_t)r->cl);
+#undef FIELD
+#undef STR
+#undef LIT
+#undef PIECE
+	for (i = 0, sz = 0; i < n; i++)
+		sz += pc[i].len;
+	if ((rq = malloc(sz + 1)) == NULL) {
+		warn("malloc()"); return (NULL);
 	}
+	for (i = 0, p = rq; i < n; i++) {
+		(void)memcpy(p, pc[i].s, pc[i].len);
+		p += pc[i].len;
+	}
+	*p   = '\0';
+	*len = sz;
+
 	return (rq);
-error:
-	while (lc--)
-		free(ln[lc]);
-	free(rq);
-	return (NULL);
+}
+
+/*
+ * Unreserved characters of RFC 3986, which urlencode() doesn't escape.
+ */
+static const u_char url_unreserved[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 00 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 10 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,	/* 20 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,	/* 30 */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 40 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,	/* 50 */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	/* 60 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,	/* 70 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 80 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 90 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* a0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* b0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* c0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* d0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* e0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0	/* f0 */
+};
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/*
+ * Returns the length of the first 'len' bytes of 's' after URL encoding.
+ */
+size_t
+urlencode_len(const char *s, size_t len)
+{
+	size_t i, n;
+
+	for (i = 0, n = len; i < len; i++) {
+		if (!url_unreserved[(u_char)s[i]])
+			n += 2;
+	}
+	return (n);
+}
+
+/*
+ * URL encodes the first 'len' bytes of 'src' into 'dst', which must have
+ * room for urlencode_len() bytes. Runs of unreserved characters are
+ * copied in one go.
+ *
+ * Returns a pointer to the end of the encoded string in 'dst'.
+ */
+char *
+urlencode_to(char *dst, const char *src, size_t len)
+{
+	u_char	   c;
+	const char *p, *end, *run;
+
+	for (p = src, end = src + len; p < end;) {
+		for (run = p; p < end && url_unreserved[(u_char)*p]; p++)
+			;
+		if (p > run) {
+			(void)memcpy(dst, run, p - run);
+			dst += p - run;
+		}
+		for (; p < end && !url_unreserved[(u_char)*p]; p++) {
+			c = (u_char)*p;
+			*dst++ = '%';
+			*dst++ = hexdigits[c >> 4];
+			*dst++ = hexdigits[c & 0x0f];
+		}
+	}
+	return (dst);
 }
 
 char *
 urlencode(const char *url)
 {
-	int	   n, buflen = 0;
-	char	   *buf = NULL;
-	const char nores[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
-			     "abcdefghijklmnopqrstuvwxyz" \
-			     "0123456789-_.~";
+	char   *buf;
+	size_t len;
 
 	if (url == NULL)
 		return (NULL);
-	buflen = strlen(url) * 3 + 1;
-	if ((buf = malloc(buflen)) == NULL)
+	len = strlen(url);
+	if ((buf = malloc(urlencode_len(url, len) + 1)) == NULL)
 		return (NULL);
-	for (n = 0; *url != '\0'; n++, url++) {
-		if (strchr(nores, (int)*url) == NULL) {
-			(void)snprintf(&buf[n], buflen - n, "%%%02x",
-			    (u_char)*url);
-			n += 2;
-		} else
-			buf[n] = *url;
-	}
-	buf[n] = '\0';
+	*urlencode_to(buf, url, len) = '\0';
+
 	return (buf);
 }
 
-int
-get_http_status(ssl_conn_t *cp)
+/*
+ * Names of the header fields kept in http_resp_t, indexed by HTTP_F_*.
+ */
+static const char *resp_fields[HTTP_NFIELDS] = {
+	"Content-Type", "Location", "ETag", "Last-Modified", "Cache-Control",
+	"Retry-After", "Date"
+};
+
+/*
+ * Frees the field values and cookies of 'rp', and resets all fields.
+ */
+static void
+resp_clear(http_resp_t *rp)
+{
+	int i;
+
+	for (i = 0; i < rp->ncookies; i++)
+		free(rp->cookies[i]);
+	for (i = 0; i < HTTP_NFIELDS; i++)
+		free(rp->field[i]);
+	free(rp->cookies);
+	(void)memset(rp, 0, sizeof(*rp));
+	rp->status   = -1;
+	rp->clen     = -1;
+	rp->encoding = HTTP_ENC_IDENTITY;
+}
+
+static void
+resp_free(void *rp)
+{
+	if (rp == NULL)
+		return;
+	resp_clear(rp);
+	free(rp);
+}
+
+/*
+ * Returns the reply structure of the connection. It is allocated on first
+ * use, and freed along with the connection.
+ */
+static http_resp_t *
+conn_reply(ssl_conn_t *cp)
+{
+	http_resp_t *rp;
+
+	if (cp->reply != NULL)
+		return (cp->reply);
+	if ((rp = malloc(sizeof(http_resp_t))) == NULL) {
+		warn("malloc()"); return (NULL);
+	}
+	(void)memset(rp, 0, sizeof(*rp));
+	resp_clear(rp);
+	cp->reply = rp;
+	cp->rfree = resp_free;
+
+	return (rp);
+}
+
+/*
+ * Adds the "name=value" part of the Set-Cookie value 'val' to the cookie
+ * list of 'rp'. The cookie attributes are dropped.
+ */
+static int
+resp_add_cookie(http_resp_t *rp, const char *val)
+{
+	char   **p, *q;
+	size_t len;
+
+	for (len = strcspn(val, ";"); len > 0 && isspace(val[len - 1]); len--)
+		;
+	if (len == 0)
+		return (0);
+	p = realloc(rp->cookies, (rp->ncookies + 1) * sizeof(char *));
+	if (p == NULL) {
+		warn("realloc()"); return (-1);
+	}
+	rp->cookies = p;
+	if ((q = malloc(len + 1)) == NULL) {
+		warn("malloc()"); return (-1);
+	}
+	(void)memcpy(q, val, len); q[len] = '\0';
+	rp->cookies[rp->ncookies++] = q;
+
+	return (0);
+}
+
+/*
+ * Parses the status line 'ln', and resets the header fields in 'rp'.
+ * HTTP/1.1 servers keep the connection open by default.
+ *
+ * Returns the status code, or -1 on error.
+ */
+static int
+http_status(char *ln, http_resp_t *rp)
 {
 	char *p, *q;
 
-	while ((p = ssl_readln(cp)) != NULL) {
-		if (strncmp(p, "HTTP/", 5) == 0) {
-			for (q = p; (q = strtok(q, " ")) != NULL; q = NULL) {
-				if (isdigit(*q))
-					return (strtol(q, NULL, 10));
+	resp_clear(rp);
+	rp->keepalive = strncmp(ln, "HTTP/1.1", 8) == 0 ? true : false;
+	if ((p = strchr(ln, ' ')) != NULL) {
+		while (*p == ' ')
+			p++;
+		rp->status = strtol(p, &q, 10);
+		if (q != p + 3 || (*q != '\0' && *q != ' '))
+			rp->status = -1;
+	}
+	if (rp->status < 100)
+		warnx("Unexpected server reply: %s", ln);
+	return (rp->status < 100 ? -1 : rp->status);
+}
+
+/*
+ * Evaluates the header line 'ln' of a server reply, and stores the field
+ * in 'rp'. Fields the client doesn't care about are ignored.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+http_header(char *ln, http_resp_t *rp)
+{
+	int  i;
+	char *val, *end;
+
+	if ((val = strchr(ln, ':')) == NULL)
+		return (0);
+	*val++ = '\0';
+	while (*val == ' ' || *val == '\t')
+		val++;
+	for (end = val + strlen(val); end > val && isspace(end[-1]); end--)
+		;
+	*end = '\0';
+
+	if (strcasecmp(ln, "Content-Length") == 0)
+		rp->clen = strtol(val, NULL, 10);
+	else if (strcasecmp(ln, "Transfer-Encoding") == 0) {
+		if (strcasestr(val, "chunked") != NULL)
+			rp->chunked = true;
+	} else if (strcasecmp(ln, "Content-Encoding") == 0) {
+		if (strcasestr(val, "gzip") != NULL)
+			rp->encoding = HTTP_ENC_GZIP;
+		else if (strcasestr(val, "deflate") != NULL)
+			rp->encoding = HTTP_ENC_DEFLATE;
+	} else if (strcasecmp(ln, "Connection") == 0) {
+		if (strcasestr(val, "close") != NULL)
+			rp->keepalive = false;
+		else if (strcasestr(val, "keep-alive") != NULL)
+			rp->keepalive = true;
+	} else if (strcasecmp(ln, "Set-Cookie") == 0)
+		return (resp_add_cookie(rp, val));
+	else {
+		for (i = 0; i < HTTP_NFIELDS; i++) {
+			if (strcasecmp(ln, resp_fields[i]) != 0)
+				continue;
+			free(rp->field[i]);
+			if ((rp->field[i] = strdup(val)) == NULL) {
+				warn("strdup()"); return (-1);
 			}
-			warnx("Unexpected server reply: %s", p);
-			return (-1);
+			break;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Called after the empty line that ends the header of a final reply.
+ */
+static void
+http_header_end(http_resp_t *rp)
+{
+	if (rp->status == HTTP_NO_CONTENT || rp->status == HTTP_NOT_MODIFIED) {
+		rp->clen = 0; rp->chunked = false;
+		rp->encoding = HTTP_ENC_IDENTITY;
+	} else if (rp->chunked)
+		rp->clen = -1;
+	if (rp->clen < 0 && !rp->chunked)
+		rp->keepalive = false;
+}
+
+/*
+ * Returns the parsed header of the last reply read by get_http_status(),
+ * or NULL if there is none.
+ */
+const http_resp_t *
+http_reply(ssl_conn_t *cp)
+{
+	http_resp_t *rp = cp->reply;
+
+	return (rp != NULL && rp->status != -1 ? rp : NULL);
+}
+
+/*
+ * Returns the "name=value" pair of the cookie 'name' the server set in
+ * the reply 'rp', or NULL. If the cookie was set more than once, the last
+ * value is returned.
+ */
+const char *
+http_cookie(const http_resp_t *rp, const char *name)
+{
+	int    i;
+	size_t len;
+
+	if (rp == NULL)
+		return (NULL);
+	len = strlen(name);
+	for (i = rp->ncookies - 1; i >= 0; i--) {
+		if (strncmp(rp->cookies[i], name, len) == 0 &&
+		    rp->cookies[i][len] == '=')
+			return (rp->cookies[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Streaming decoder for chunked replies. The raw reply body is passed to
+ * http_chunked() in pieces of any size. Each piece of chunk data is passed
+ * to the data callback as soon as it arrives. Chunk extensions are
+ * skipped, and trailer fields are passed to the optional trailer
+ * callback.
+ */
+void
+http_chunked_init(http_chunked_t *ch, int (*data)(void *, const char *,
+		  size_t), int (*trailer)(void *, char *), void *arg)
+{
+	(void)memset(ch, 0, sizeof(*ch));
+	ch->arg	    = arg;
+	ch->data    = data;
+	ch->trailer = trailer;
+	ch->state   = HTTP_CHUNK_SIZE;
+}
+
+/*
+ * Decodes the 'len' bytes in 'buf'.
+ *
+ * Returns the number of bytes consumed, which is less than 'len' only if
+ * the end of the body was reached, and -1 on error.
+ */
+long
+http_chunked(http_chunked_t *ch, const char *buf, size_t len)
+{
+	int	   d;
+	size_t	   i, n;
+	const char *p;
+
+	for (i = 0; i < len && ch->state != HTTP_CHUNK_DONE;) {
+		p = buf + i;
+		switch (ch->state) {
+		case HTTP_CHUNK_SIZE:
+			i++;
+			if (*p == '\n') {
+				if (ch->ndigits == 0)
+					goto error;
+				ch->state = ch->left > 0 ? HTTP_CHUNK_DATA :
+					    HTTP_CHUNK_TRAILER;
+				ch->ndigits = ch->ext = 0;
+				ch->lnlen = 0;
+			} else if (ch->ext || *p == '\r')
+				;
+			else if (*p == ';' || *p == ' ' || *p == '\t')
+				ch->ext = 1;
+			else if (isxdigit((unsigned char)*p)) {
+				d = isdigit((unsigned char)*p) ? *p - '0' :
+				    tolower((unsigned char)*p) - 'a' + 10;
+				if (ch->left > (LONG_MAX - d) / 16)
+					goto error;
+				ch->left = ch->left * 16 + d;
+				ch->ndigits++;
+			} else
+				goto error;
+			break;
+		case HTTP_CHUNK_DATA:
+			n = len - i;
+			if (n > (size_t)ch->left)
+				n = ch->left;
+			if (ch->data != NULL && ch->data(ch->arg, p, n) == -1)
+				return (-1);
+			i += n;
+			if ((ch->left -= n) == 0)
+				ch->state = HTTP_CHUNK_DATA_END;
+			break;
+		case HTTP_CHUNK_DATA_END:
+			i++;
+			if (*p == '\n')
+				ch->state = HTTP_CHUNK_SIZE;
+			else if (*p != '\r')
+				goto error;
+			break;
+		case HTTP_CHUNK_TRAILER:
+			i++;
+			if (*p != '\n') {
+				if (ch->lnlen < sizeof(ch->ln) - 1)
+					ch->ln[ch->lnlen++] = *p;
+				break;
+			}
+			if (ch->lnlen > 0 && ch->ln[ch->lnlen - 1] == '\r')
+				ch->lnlen--;
+			ch->ln[ch->lnlen] = '\0';
+			if (ch->lnlen == 0)
+				ch->state = HTTP_CHUNK_DONE;
+			else if (ch->trailer != NULL &&
+			    ch->trailer(ch->arg, ch->ln) == -1)
+				return (-1);
+			ch->lnlen = 0;
+			break;
 		}
 	}
+	return ((long)i);
+error:
+	warnx("Malformed chunked reply");
 	return (-1);
 }
 
-int
-http_get(ssl_conn_t *cp, const char *url, const char *cookie,
-	 const char *accept, const char *agent)
+/*
+ * Data callback that moves the decoded data to the output position
+ * '*arg'. Since decoded data is never longer than the input, the decoder
+ * can work in place.
+ */
+static int
+chunk_copy(void *arg, const char *data, size_t len)
 {
-	char	   *rq;
-	http_req_t hdr;
+	char **out = arg;
 
-	(void)memset(&hdr, 0, sizeof(hdr));
-	hdr.ua       = agent;
-	hdr.url	     = url;
-	hdr.type     = HTTP_RQ_TYPE_GET;
-	hdr.host     = cp->host;
-	hdr.cookie   = cookie;
-	hdr.accept   = accept;
-	hdr.location = url; 
+	(void)memmove(*out, data, len);
+	*out += len;
 
-	if ((rq = http_gen_req(&hdr)) == NULL)
-		return (-1);
-	if (ssl_write(cp, rq, strlen(rq)) == -1) {
-		free(rq); return (-1);
+	return (0);
+}
+
+static int
+decoder_init(http_decoder_t *dc, const http_resp_t *hp)
+{
+	(void)memset(dc, 0, sizeof(*dc));
+	if ((dc->chunked = hp->chunked))
+		http_chunked_init(&dc->ch, chunk_copy, NULL, NULL);
+	if (hp->encoding == HTTP_ENC_IDENTITY)
+		return (0);
+	/* Accept zlib and gzip headers, because some servers send zlib
+	 * streams as "gzip", and gzip streams as "deflate". */
+	if (inflateInit2(&dc->z, MAX_WBITS + 32) != Z_OK) {
+		warnx("inflateInit2() failed"); return (-1);
 	}
-	free(rq);
-	return (get_http_status(cp));
+	dc->inflate = true;
+
+	return (0);
 }
 
-int
-http_post(ssl_conn_t *cp, const char *url, const char *cookie,
-	 const char *accept, const char *agent, int type, const char *content)
+static void
+decoder_end(http_decoder_t *dc)
 {
-	char	   *rq;
-	http_req_t hdr;
+	if (dc->inflate)
+		(void)inflateEnd(&dc->z);
+	dc->inflate = false;
+	free(dc->zin); dc->zin = NULL;
+}
 
-	(void)memset(&hdr, 0, sizeof(hdr));
-	hdr.url      = url;
-	hdr.ua       = agent;
-	hdr.host     = cp->host;
-	hdr.type     = HTTP_RQ_TYPE_POST;
-	hdr.cookie   = cookie;
-	hdr.accept   = accept;
-	hdr.location = url;
+static void
+decoder_free(void *dc)
+{
+	decoder_end(dc);
+	free(dc);
+}
 
-	if (type == HTTP_POST_TYPE_JSON)
-		hdr.ct = "application/json; charset=UTF-8";
-	else if (type == HTTP_POST_TYPE_OCTET)
-		hdr.ct = "application/octet-stream";
-	else {
-		hdr.ct = "application/x-www-form-" \
-			 "urlencoded;charset=utf-8";
+/*
+ * Decodes the chunked data in 'buf' in place. The number of decoded bytes
+ * is stored in 'outlen'.
+ *
+ * Returns the number of bytes consumed, or -1 on error.
+ */
+static long
+decoder_dechunk(http_decoder_t *dc, char *buf, size_t len, size_t *outlen)
+{
+	long n;
+	char *out;
+
+	if (!dc->chunked) {
+		*outlen = len; return ((long)len);
 	}
-	if (content != NULL)
-		hdr.cl = strlen(content);
-	if ((rq = http_gen_req(&hdr)) == NULL)
+	out = buf; dc->ch.arg = &out;
+	if ((n = http_chunked(&dc->ch, buf, len)) == -1)
+		return (-1);
+	*outlen = out - buf;
+
+	return (n);
+}
+
+/*
+ * Inflates the pending input of the decoder into 'buf'.
+ *
+ * Returns the number of bytes produced, or -1 on error.
+ */
+static int
+decoder_inflate(http_decoder_t *dc, char *buf, size_t size)
+{
+	int ret;
+
+	dc->z.next_out	= (Bytef *)buf;
+	dc->z.avail_out = size;
+	ret = inflate(&dc->z, Z_NO_FLUSH);
+	if (ret == Z_STREAM_END)
+		dc->zend = true;
+	else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		warnx("inflate(): %s", dc->z.msg != NULL ? dc->z.msg :
+		    "Invalid compressed data");
 		return (-1);
-	if (ssl_write(cp, rq, strlen(rq)) == -1) {
-		free(rq); return (-1);
 	}
-	free(rq);
-	if (content != NULL) {
-		if (ssl_write(cp, content, hdr.cl) == -1)
+	return (size - dc->z.avail_out);
+}
+
+/*
+ * Reads and de-chunks the next piece of the body.
+ */
+static int
+body_recv(ssl_conn_t *cp, http_decoder_t *dc, int waitsecs, char *buf,
+	  int size)
+{
+	int    n;
+	long   used;
+	size_t len;
+
+	do {
+		if ((n = ssl_recv(cp, waitsecs, buf, size)) <= 0 || !dc->chunked)
+			return (n);
+		if ((used = decoder_dechunk(dc, buf, n, &len)) == -1)
 			return (-1);
+		if (dc->ch.state == HTTP_CHUNK_DONE) {
+			cp->limit = 0;
+			if (used < n)
+				cp->keepalive = 0;
+		}
+	} while (len == 0 && cp->limit != 0);
+
+	return ((int)len);
+}
+
+/*
+ * Input filter for ssl_read(), which decodes chunked and compressed
+ * replies while they are read.
+ */
+static int
+body_filter(ssl_conn_t *cp, int waitsecs, void *buf, int size)
+{
+	int	       n;
+	http_decoder_t *dc;
+
+	dc = cp->fdata;
+	if (!dc->inflate)
+		return (body_recv(cp, dc, waitsecs, buf, size));
+	while (!dc->zend) {
+		if (dc->z.avail_in == 0) {
+			n = body_recv(cp, dc, waitsecs, dc->zin, dc->zinsz);
+			if (n <= 0)
+				return (n);
+			dc->z.next_in  = (Bytef *)dc->zin;
+			dc->z.avail_in = n;
+		}
+		if ((n = decoder_inflate(dc, buf, size)) != 0)
+			return (n);
 	}
-	return (get_http_status(cp));
+	/* Skip the rest of the message, e.g. the last chunk. */
+	while (cp->limit != 0) {
+		if ((n = body_recv(cp, dc, waitsecs, dc->zin, dc->zinsz)) <= 0)
+			return (n);
+	}
+	return (0);
 }
 
-int
-http_delete(ssl_conn_t *cp, const char *url, const char *cookie,
-	    const char *agent)
+/*
+ * Installs the decoder for the body of the reply. The part of the body
+ * that was read along with the header is decoded, too.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+body_decoder(ssl_conn_t *cp, const http_resp_t *hp)
 {
-	char	   *rq;
-	http_req_t hdr;
+	long	       used;
+	size_t	       len;
+	http_decoder_t *dc;
 
-	(void)memset(&hdr, 0, sizeof(hdr));
-	hdr.url	     = url;
-	hdr.cookie   = cookie;
-	hdr.ua	     = agent;
-	hdr.type     = HTTP_RQ_TYPE_DELETE;
-	hdr.host     = cp->host;
-	hdr.location = url;
+	if (!hp->chunked && hp->encoding == HTTP_ENC_IDENTITY)
+		return (0);
+	if ((dc = malloc(sizeof(http_decoder_t))) == NULL) {
+		warn("malloc()"); return (-1);
+	}
+	if (decoder_init(dc, hp) == -1) {
+		free(dc); return (-1);
+	}
+	ssl_set_filter(cp, body_filter, dc, decoder_free);
 
-	if ((rq = http_gen_req(&hdr)) == NULL)
+	len  = cp->rd - cp->slen;
+	used = decoder_dechunk(dc, cp->lnbuf + cp->slen, len, &len);
+	if (used == -1)
 		return (-1);
-	if (ssl_write(cp, rq, strlen(rq)) == -1) {
-		free(rq); return (-1);
+	if (dc->chunked && dc->ch.state == HTTP_CHUNK_DONE) {
+		cp->limit = 0;
+		if (used < cp->rd - cp->slen)
+			cp->keepalive = 0;
 	}
-	free(rq);
-	return (get_http_status(cp));
+	cp->rd = cp->slen + len;
+	if (!dc->inflate)
+		return (0);
+	/* Move the compressed data to the decoder's input buffer. */
+	dc->zinsz = len > HTTP_ZBUF_SIZE ? len : HTTP_ZBUF_SIZE;
+	if ((dc->zin = malloc(dc->zinsz)) == NULL) {
+		warn("malloc()"); return (-1);
+	}
+	(void)memcpy(dc->zin, cp->lnbuf + cp->slen, len);
+	dc->z.next_in  = (Bytef *)dc->zin;
+	dc->z.avail_in = len;
+	cp->rd	       = cp->slen;
+
+	return (0);
+}
+
+/*
+ * Checks whether the complete body of the reply was read.
+ */
+static bool
+body_complete(ssl_conn_t *cp)
+{
+	http_decoder_t *dc;
+
+	dc = cp->filter == body_filter ? cp->fdata : NULL;
+	if (dc != NULL && dc->inflate && !dc->zend)
+		return (false);
+	if (dc != NULL && dc->chunked)
+		return (dc->ch.state == HTTP_CHUNK_DONE);
+	if (cp->limit < 0)
+		return (cp->state != SSL_STATE_CONNECTED);
+	return (cp->limit == 0);
 }
 
+/*
+ * Reads the status line and the header of the server reply. The length
+ * of the message body is passed to the SSL layer, so the connection can
+ * be reused after the body was read.
+ *
+ * Returns the status code, or -1 on error.
+ */
 int
-http_upload(ssl_conn_t *cp, const char *url, const char *cookie,
-	    const char *accept, const char *agent, const char *file)
+get_http_status(ssl_conn_t *cp)
 {
-	int	   n;
-	long	   len;
-	FILE	   *fp;
-	char	   *rq, buf[1024];
-	http_req_t hdr;
+	int	    status;
+	char	    *p;
+	http_resp_t *rp;
 
-	if ((fp = fopen(file, "r")) == NULL) {
-		warn("%s", file); return (-1);
-	}
-	if (fseek(fp, 0, SEEK_END) == -1) {
-		warn("fseek()"); (void)fclose(fp); return (-1);
+	if ((rp = conn_reply(cp)) == NULL)
+		return (-1);
+	do {
+		while ((p = ssl_readln(cp)) != NULL) {
+			if (strncmp(p, "HTTP/", 5) == 0)
+				break;
+		}
+		if (p == NULL || (status = http_status(p, rp)) == -1)
+			return (-1);
+		while ((p = ssl_readln(cp)) != NULL && *p != '\0') {
+			if (http_header(p, rp) == -1)
+				return (-1);
+		}
+		/* Skip interim replies (1xx). */
+	} while (p != NULL && status >= 100 && status < 200);
+
+	if (p == NULL)
+		rp->keepalive = false;
+	http_header_end(rp);
+	cp->keepalive = rp->keepalive ? 1 : 0;
+	if (rp->clen >= 0)
+		ssl_set_limit(cp, rp->clen);
+	if (p != NULL && body_decoder(cp, rp) == -1)
+		return (-1);
+	return (status);
+}
+
+/*
+ * Reads the body of the reply whose header was read by get_http_status()
+ * into one contiguous, '\0'-terminated buffer. If the server sent a
+ * Content-Length, the buffer is allocated in one go, and exactly that
+ * many bytes are read. Otherwise the body is read until the server
+ * closes the connection. The length of the body is stored in 'len'.
+ *
+ * Returns the body, or NULL on error.
+ */
+char *
+http_read_body(ssl_conn_t *cp, size_t *len)
+{
+	int    n;
+	char   *body, *p;
+	size_t sz, rd;
+
+	rd = cp->rd - cp->slen;
+	if (cp->limit >= 0)
+		sz = rd + cp->limit + 1;
+	else
+		sz = rd + HTTP_BODY_BUFSZ;
+	if ((body = malloc(sz)) == NULL) {
+		warn("malloc()"); return (NULL);
 	}
-	if ((len = ftell(fp)) == -1) {
-		warn("ftell()"); (void)fclose(fp); return (-1);
+	if (rd > 0)
+		(void)memcpy(body, cp->lnbuf + cp->slen, rd);
+	cp->slen = cp->rd = 0;
+	for (;;) {
+		if (rd + 1 >= sz) {
+			if ((p = realloc(body, sz * 2)) == NULL) {
+				warn("realloc()"); free(body); return (NULL);
+			}
+			body = p; sz *= 2;
+		}
+		n = ssl_read(cp, SSL_IO_TIMEOUT, body + rd, sz - rd - 1 > INT_MAX ?
+		    INT_MAX : (int)(sz - rd - 1));
+		if (n < 0) {
+			free(body); return (NULL);
+		} else if (n == 0)
+			break;
+		rd += n;
 	}
-	if (len > HTTP_FILESZ_LIMIT) {
-		warnx("'%s' exceeds file size-limit of %d MB", file,
-		    HTTP_FILESZ_LIMIT / (1024 * 1024));
-		(void)fclose(fp); return (-1);
+	if (!body_complete(cp)) {
+		/* Timeout, or connection closed before the end. */
+		warnx("Incomplete reply from %s", cp->host);
+		free(body); return (NULL);
 	}
-	(void)memset(&hdr, 0, sizeof(hdr));
-	hdr.ua	   = agent;
-	hdr.cl	   = (int)len;
-	hdr.ct	   = "application/octet-stream";
-	hdr.url	   = url;
-	hdr.type   = HTTP_RQ_TYPE_POST;
-	hdr.host   = cp->host;
-	hdr.cookie = cookie;
-	hdr.accept = accept;
+	body[rd] = '\0';
+	*len = rd;
 
-	if ((rq = http_gen_req(&hdr)) == NULL) {
-		(void)fclose(fp); return (-1);
-	}
-	if (ssl_write(cp, rq, strlen(rq)) == -1) {
-		free(rq); (void)fclose(fp); return (-1);
+	return (body);
+}
+
+/*
+ * Resets the per-reply state of the connection before sending a new
+ * request.
+ */
+static void
+http_begin(ssl_conn_t *cp)
+{
+	cp->nreq++;
+	cp->keepalive = 0;
+	ssl_set_limit(cp, -1);
+	ssl_set_filter(cp, NULL, NULL, NULL);
+	if (cp->reply != NULL)
+		resp_clear(cp->reply);
+}
+
+/*
+ * Connects a connection returned by http_pool_get() on first use.
+ */
+static int
+http_connect(ssl_conn_t *cp)
+{
+	if (cp->state != SSL_STATE_DISCONNECTED)
+		return (0);
+	if (http_offline) {
+		warnx("Not connecting to %s in offline mode", cp->host);
+		return (-1);
 	}
-	free(rq);
+	return (ssl_reconnect(cp));
+}
 
-	rewind(fp);
-	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-		if (ssl_write(cp, buf, n) == -1) {
-			(void)fclose(fp); return (-1);
-		}
+/*
+ * Retry policy
+ *
+ * A request that failed for a transient reason is sent again after a
+ * pause. Transient are failures to connect, failed TLS handshakes,
+ * timeouts, broken connections, and the status codes 429, 500, 502, 503
+ * and 504. A POST request might have been processed already if the
+ * connection broke or timed out, or the server replied with 500, 502 or
+ * 504. So it's only sent again if it never reached the server (connect
+ * and TLS failures), or the server says it wasn't processed (429, 503).
+ * Idempotent requests get HTTP_RETRIES retries, POST requests
+ * HTTP_RETRIES_POST.
+ *
+ * The pause doubles with each retry from HTTP_BACKOFF_BASE up to
+ * HTTP_BACKOFF_MAX ms, and a random part of up to half of it keeps
+ * clients that failed at the same time from coming back at the same
+ * time. A Retry-After field in the reply overrides it.
+ */
+
+/*
+ * Returns the number of seconds the Retry-After field of the reply asks
+ * to wait, or -1 if there is none.
+ */
+static long
+retry_after(const http_resp_t *rp)
+{
+	long	   secs;
+	char	   *end;
+	struct tm  tm;
+	const char *p;
+
+	if ((p = rp->field[HTTP_F_RETRY_AFTER]) == NULL)
+		return (-1);
+	secs = strtol(p, &end, 10);
+	if (end == p) {
+		/* HTTP-date */
+		(void)memset(&tm, 0, sizeof(tm));
+		if (strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+			return (-1);
+		secs = (long)(timegm(&tm) - time(NULL));
 	}
-	(void)fclose(fp);
+	return (secs > 0 ? secs : 0);
+}
 
-	return (get_http_status(cp));
+/*
+ * Returns the randomized pause in ms before retry 'attempt' (counted from
+ * 0).
+ */
+static long
+backoff(int attempt)
+{
+	long	    ms;
+	static bool seeded = false;
+
+	if (!seeded) {
+		srandom((u_int)time(NULL) ^ (u_int)getpid());
+		seeded = true;
+	}
+	for (ms = HTTP_BACKOFF_BASE; attempt > 0 && ms < HTTP_BACKOFF_MAX;
+	    attempt--)
+		ms *= 2;
+	if (ms > HTTP_BACKOFF_MAX)
+		ms = HTTP_BACKOFF_MAX;
+	return (ms / 2 + random() % (ms / 2 + 1));
 }
 
+/*
+ * Decides whether a request is sent again after the failed attempt
+ * 'attempt' (counted from 0). 'status' is the status code of the reply
+ * 'rp', or -1 if the request failed with the failure class 'error'
+ * (SSL_ERR_*).
+ *
+ * Returns the number of ms to wait before the next attempt, or -1 if the
+ * request must not be sent again.
+ */
+static long
+retry_delay(bool idempotent, int attempt, int status, int error,
+	    const http_resp_t *rp)
+{
+	long ms, secs;
+	bool unsent;
+
+	switch (status) {
+	case -1:
+		if (error == SSL_ERR_NONE || error == SSL_ERR_DEADLINE)
+			return (-1);
+		unsent = error == SSL_ERR_CONNECT || error == SSL_ERR_TLS;
+		break;
+	case HTTP_TOO_MANY_REQUESTS:
+	case HTTP_UNAVAILABLE:
+		unsent = true;
+		break;
+	case HTTP_SERVER_ERROR:
+	case HTTP_BAD_GATEWAY:
+	case HTTP_GATEWAY_TIMEOUT:
+		unsent = false;
+		break;
+	default:
+		return (-1);
+	}
+	if (!idempotent && !unsent)
+		return (-1);
+	if (attempt >= (idempotent ? HTTP_RETRIES : HTTP_RETRIES_POST))
+		return (-1);
+	if (status != -1 && (secs = retry_after(rp)) >= 0) {
+		/* Don't wait longer than the user would. */
+		if (secs > HTTP_RETRY_AFTER_MAX)
+			return (-1);
+		ms = secs * 1000;
+	} else
+		ms = backoff(attempt);
+	/* No point in waiting if the deadline passes meanwhile. */
+	return (ssl_time_left((int)ms) < ms ? -1 : ms);
+}
+
+/*
+ * Applies the retry policy to the failed attempt 'attempt' of a request
+ * on 'cp'. If the request is to be sent again, it waits, and prepares
+ * the connection for the next attempt.
+ *
+ * Returns true if the request should be sent again.
+ */
+static bool
+http_retry(ssl_conn_t *cp, bool idempotent, int attempt, int status)
+{
+	long		  ms;
+	static const char *what[] = {
+		"", "Connection failed", "TLS handshake failed", "Timeout",
+		"Connection lost"
+	};
+
+	ms = retry_delay(idempotent, attempt, status, ssl_error,
+	    status == -1 ? NULL : http_reply(cp));
+	if (ms < 0)
+		return (false);
+	if (status != -1) {
+		warnx("Server replied with code %d. Trying again in %.1f s",
+		    status, ms / 1000.0);
+	} else
+		warnx("%s. Trying again in %.1f s", what[ssl_error],
+		    ms / 1000.0);
+	if (status == -1 || !cp->keepalive ||
+	    ssl_drain(cp, HTTP_DRAIN_LIMIT) == -1) {
+		/* http_connect() reconnects. */
+		cp->state = SSL_STATE_DISCONNECTED;
+	}
+	(void)poll(NULL, 0, (int)ms);
+
+	return (true);
+}
+
+/*
+ * Waits before retry 'attempt' (counted from 0) of an operation like the
+ * retry policy does. The operation may be retried 'retries' times.
+ *
+ * Returns 0, or -1 without waiting if the retries are used up, or the
+ * deadline would pass.
+ */
+int
+http_backoff(int attempt, int retries)
+{
+	long ms;
+
+	if (attempt >= retries)
+		return (-1);
+	ms = backoff(attempt);
+	if (ssl_time_left((int)ms) < ms)
+		return (-1);
+	(void)poll(NULL, 0, (int)ms);
+
+	return (0);
+}
+
+/*
+ * Sends the request header 'rq' and the optional body, and reads the
+ * status of the reply. If an idempotent request fails on a reused
+ * connection, the server probably closed the connection while it was
+ * idle. In this case we reconnect and try again right away. Other
+ * failures are up to the retry policy.
+ */
+static int
+http_send(ssl_conn_t *cp, const char *rq, size_t rqlen, const char *body,
+	  size_t len, bool idempotent)
+{
+	int	  n, status;
+	bool	  reused;
+	ssl_iov_t iov[2];
+
+	iov[0].base = rq;   iov[0].len = rqlen;
+	iov[1].base = body; iov[1].len = body != NULL ? len : 0;
+	for (n = 0;;) {
+		ssl_error = SSL_ERR_NONE;
+		status	  = -1;
+		reused	  = false;
+		if (http_connect(cp) == 0) {
+			reused = cp->nreq > 0 ? true : false;
+			http_begin(cp);
+			if (ssl_writev(cp, iov, 2) == 0)
+				status = get_http_status(cp);
+		}
+		if (status == -1 && reused && idempotent)
+			cp->state = SSL_STATE_DISCONNECTED;
+		else if (!http_retry(cp, idempotent, n++, status))
+			return (status);
+	}
+}
+
+/*
+ * Input filter that passes a document from memory to the reader.
+ */
+static int
+cached_filter(ssl_conn_t *cp, int waitsecs, void *buf, int size)
+{
+	size_t	      n;
+	cache_entry_t *ce = cp->fdata;
+
+	(void)waitsecs;
+	n = ce->len < (size_t)size ? ce->len : (size_t)size;
+	(void)memcpy(buf, ce->data, n);
+	ce->data += n;
+	ce->len  -= n;
+
+	return ((int)n);
+}
+
+static void
+cached_free(void *ce)
+{
+	cache_entry_free(ce);
+}
+
+/*
+ * Lets the caller read the document 'ce' as the body of the reply.
+ */
+static void
+serve_cached(ssl_conn_t *cp, cache_entry_t *ce)
+{
+	ssl_set_filter(cp, cached_filter, ce, cached_free);
+	cp->slen = cp->rd = 0;
+	ssl_set_limit(cp, 0);
+}
+
+/*
+ * Returns the key of the cache entry for a GET request. Documents are
+ * cached per session, and per accepted content type.
+ */
+static char *
+cache_key(const char *host, const char *url, const char *cookie,
+	  const char *accept)
+{
+	char   *key;
+	size_t len;
+
+	if (cookie == NULL)
+		cookie = "";
+	if (accept == NULL)
+		accept = "";
+	len = strlen(host) + strlen(url) + strlen(cookie) + strlen(accept) + 4;
+	if ((key = malloc(len)) == NULL) {
+		warn("malloc()"); return (NULL);
+	}
+	(void)snprintf(key, len, "%s %s\n%s\n%s", host, url, accept, cookie);
+	return (key);
+}
+
+/*
+ * Returns the entry of http_ttls that matches 'url', or NULL if documents
+ * under 'url' are not cached.
+ */
+static const http_ttl_t *
+cache_rule(const char *url)
+{
+	const http_ttl_t *tp;
+
+	for (tp = http_ttls; tp != NULL && tp->prefix != NULL; tp++) {
+		if (strncmp(url, tp->prefix, strlen(tp->prefix)) == 0)
+			return (tp);
+	}
+	return (NULL);
+}
+
+/*
+ * Returns the number of seconds a cached copy of the document matching
+ * 'tp' may be used without asking the server.
+ */
+static long
+cache_ttl(const http_ttl_t *tp)
+{
+	if (http_max_age >= 0)
+		return (http_max_age);
+	return (tp->secs);
+}
+
+/*
+ * Looks up the cached copy of a document. The cache key is stored in
+ * 'key', and 'fresh' tells whether the copy can be used without asking
+ * the server. In offline mode, every cached copy is fresh. Only the
+ * documents listed in http_ttls are cached; for other URLs, 'key' is
+ * set to NULL.
+ *
+ * Returns the cache entry, or NULL.
+ */
+static cache_entry_t *
+cache_lookup(const char *host, const char *url, const char *cookie,
+	     const char *accept, char **key, bool *fresh)
+{
+	cache_entry_t	 *ce;
+	const http_ttl_t *tp;
+
+	*fresh = false;
+	*key   = NULL;
+	if (!http_cache && !http_offline)
+		return (NULL);
+	if ((tp = cache_rule(url)) == NULL) {
+		if (http_offline)
+			warnx("%s: Not in cache", url);
+		return (NULL);
+	}
+	if ((*key = cache_key(host, url, cookie, accept)) == NULL)
+		return (NULL);
+	if ((ce = cache_entry_get(*key)) == NULL) {
+		if (http_offline)
+			warnx("%s: Not in cache", url);
+		return (NULL);
+	}
+	*fresh = http_offline || time(NULL) - ce->mtime < cache_ttl(tp);
+
+	return (ce);
+}
+
+/*
+ * Checks whether the reply 'rp' may be stored in the cache. Replies that
+ * set cookies belong to the session, not to the document.
+ */
+static bool
+cache_storable(const http_resp_t *rp)
+{
+	const char *cc;
+
+	if (rp->ncookies > 0)
+		return (false);
+	cc = rp->field[HTTP_F_CACHE_CONTROL];
+	return (cc == NULL || strcasestr(cc, "no-store") == NULL);
+}
+
+/*
+ * Handles the reply to a GET request for the document cached under 'key'.
+ * If the server replied with 304, the cached document 'ce' is passed to
+ * the caller as the body of a 200 reply. A new document is read, stored
+ * in the cache, and passed to the caller in the same way.
+ *
+ * Returns the status code, or -1 on error.
+ */
+static int
+cache_reply(ssl_conn_t *cp, int status, const char *key, cache_entry_t *ce)
+{
+	char		  *body;
+	size_t		  len;
+	const http_resp_t *rp;
+
+	if (status == HTTP_NOT_MODIFIED && ce != NULL) {
+		cache_entry_touch(key);
+		serve_cached(cp, ce);
+		return (HTTP_OK);
+	}
+	cache_entry_free(ce);
+	if (status != HTTP_OK || (rp = http_reply(cp)) == NULL ||
+	    !cache_storable(rp))
+		return (status);
+	if ((ce = malloc(sizeof(*ce))) == NULL) {
+		warn("malloc()"); return (-1);
+	}
+	(void)memset(ce, 0, sizeof(*ce));
+	if ((body = http_read_body(cp, &len)) == NULL) {
+		free(ce); return (-1);
+	}
+	(void)cache_entry_put(key, rp->field[HTTP_F_ETAG],
+	    rp->field[HTTP_F_LAST_MODIFIED], body, len);
+	ce->buf = ce->data = body;
+	ce->len = len;
+	serve_cached(cp, ce);
+
+	return (status);
+}
+
+/*
+ * Sends a GET request. If a copy of the document is in the cache, and
+ * it's not older than its TTL, no request is sent at all. Otherwise the
+ * request is made conditional, and the cached copy is used if it is
+ * still valid.
+ */
+int
+http_get(ssl_conn_t *cp, const char *url, const char *cookie,
+	 const char *accept, const char *agent)
+{
+	int	      status;
+	bool	      fresh;
+	char	      *rq, *key;
+	size_t	      len;
+	http_req_t    hdr;
+	cache_entry_t *ce;
+
+	ce = cache_lookup(cp->host, url, cookie, accept, &key, &fresh);
+	if (fresh) {
+		free(key);
+		if (cp->reply != NULL)
+			resp_clear(cp->reply);
+		serve_cached(cp, ce);
+		return (HTTP_OK);
+	} else if (http_offline) {
+		free(key); return (-1);
+	}
+	(void)memset(&hdr, 0, sizeof(hdr));
+	hdr.ua       = agent;
+	hdr.url	     = url;
+	hdr.type     = HTTP_RQ_TYPE_GET;
+	hdr.host     = cp->host;
+	hdr.cookie   = cookie;
+	hdr.accept   = accept;
+	hdr.location = url; 
+	if (ce != NULL) {
+		hdr.etag    = ce->etag;
+		hdr.lastmod = ce->lastmod;
+	}
+	if ((rq = http_gen_req(&hdr, &len)) == NULL) {
+		free(key); cache_entry_free(ce); return (-1);
+	}
+	status = http_send(cp, rq, len, NULL, 0, true);
+	free(rq);
+	if (key != NULL)
+		status = cache_reply(cp, status, key, ce);
+	free(key);
+
+	return (status);
+}
+
+static const char *
+content_type(int type)
+{
+	if (type == HTTP_POST_TYPE_JSON)
+		return ("application/json; charset=UTF-8");
+	else if (type == HTTP_POST_TYPE_OCTET)
+		return ("application/octet-stream");
+	return ("application/x-www-form-urlencoded;charset=utf-8");
+}
+
+int
+http_post(ssl_conn_t *cp, const char *url, const char *cookie,
+	 const char *accept, const char *agent, int type, const char *content)
+{
+	int	   status;
+	char	   *rq;
+	size_t	   len;
+	http_req_t hdr;
+
+	(void)memset(&hdr, 0, sizeof(hdr));
+	hdr.url      = url;
+	hdr.ua       = agent;
+	hdr.host     = cp->host;
+	hdr.type     = HTTP_RQ_TYPE_POST;
+	hdr.cookie   = cookie;
+	hdr.accept   = accept;
+	hdr.location = url;
+
+	hdr.ct	     = content_type(type);
+	if (content != NULL)
+		hdr.cl = strlen(content);
+	/* Small bodies are sent along with the header. */
+	if (hdr.cl <= HTTP_INLINE_BODY)
+		hdr.body = content;
+	if ((rq = http_gen_req(&hdr, &len)) == NULL)
+		return (-1);
+	status = http_send(cp, rq, len, hdr.body == NULL ? content : NULL,
+	    hdr.cl, false);
+	free(rq);
+
+	return (status);
+}
+
+/*
+ * Buffer for streaming a request to the connection in record-sized
+ * pieces.
+ */
+typedef struct http_writer_s {
+	ssl_conn_t *cp;
+	size_t	   len;
+	char	   buf[SSL_RECORD_SIZE];
+} http_writer_t;
+
+static int
+writer_flush(http_writer_t *wp)
+{
+	ssl_iov_t iov;
+
+	if (wp->len == 0)
+		return (0);
+	iov.base = wp->buf; iov.len = wp->len;
+	wp->len	 = 0;
+
+	return (ssl_writev(wp->cp, &iov, 1));
+}
+
+/*
+ * Appends the 'len' bytes at 's' to the request, URL encoded if 'encode'
+ * is true. Full buffers are written to the connection.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+writer_put(http_writer_t *wp, const char *s, size_t len, bool encode)
+{
+	size_t n, room;
+
+	while (len > 0) {
+		room = sizeof(wp->buf) - wp->len;
+		if (room < 3) {
+			if (writer_flush(wp) == -1)
+				return (-1);
+			continue;
+		}
+		if (encode) {
+			/* Every byte takes up to three bytes. */
+			n = len < room / 3 ? len : room / 3;
+			wp->len = urlencode_to(wp->buf + wp->len, s, n) -
+			    wp->buf;
+		} else {
+			n = len < room ? len : room;
+			(void)memcpy(wp->buf + wp->len, s, n);
+			wp->len += n;
+		}
+		s += n; len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Sends a form with the 'nfields' fields in 'fields' as an
+ * application/x-www-form-urlencoded POST request. The length of the
+ * encoded form is computed first. The fields are then encoded straight
+ * into the send buffer, behind the request header.
+ *
+ * Returns the status code of the reply, or -1 on error.
+ */
+static int
+post_form(ssl_conn_t *cp, const char *url, const char *cookie,
+	  const char *accept, const char *agent, const http_field_t *fields,
+	  int nfields)
+{
+	int	      i;
+	char	      *rq;
+	size_t	      cl, rqlen;
+	http_req_t    hdr;
+	http_writer_t w;
+
+	for (i = 0, cl = 0; i < nfields; i++) {
+		cl += urlencode_len(fields[i].name, strlen(fields[i].name)) +
+		    urlencode_len(fields[i].value, strlen(fields[i].value)) +
+		    (i > 0 ? 2 : 1);
+	}
+	if (cl > INT_MAX) {
+		warnx("Form too large"); return (-1);
+	}
+	(void)memset(&hdr, 0, sizeof(hdr));
+	hdr.cl	     = (int)cl;
+	hdr.url      = url;
+	hdr.ua       = agent;
+	hdr.host     = cp->host;
+	hdr.type     = HTTP_RQ_TYPE_POST;
+	hdr.cookie   = cookie;
+	hdr.accept   = accept;
+	hdr.location = url;
+	hdr.ct	     = content_type(HTTP_POST_TYPE_FORM);
+
+	if ((rq = http_gen_req(&hdr, &rqlen)) == NULL)
+		return (-1);
+	if (http_connect(cp) == -1) {
+		free(rq); return (-1);
+	}
+	http_begin(cp);
+	w.cp = cp; w.len = 0;
+	if (writer_put(&w, rq, rqlen, false) == -1) {
+		free(rq); return (-1);
+	}
+	free(rq);
+	for (i = 0; i < nfields; i++) {
+		if ((i > 0 && writer_put(&w, "&", 1, false) == -1) ||
+		    writer_put(&w, fields[i].name, strlen(fields[i].name),
+		    true) == -1 || writer_put(&w, "=", 1, false) == -1 ||
+		    writer_put(&w, fields[i].value, strlen(fields[i].value),
+		    true) == -1)
+			return (-1);
+	}
+	if (writer_flush(&w) == -1)
+		return (-1);
+	return (get_http_status(cp));
+}
+
+int
+http_post_form(ssl_conn_t *cp, const char *url, const char *cookie,
+	       const char *accept, const char *agent, const http_field_t *fields,
+	       int nfields)
+{
+	int n, status;
+
+	for (n = 0;; n++) {
+		ssl_error = SSL_ERR_NONE;
+		status = post_form(cp, url, cookie, accept, agent, fields,
+		    nfields);
+		if (!http_retry(cp, false, n, status))
+			return (status);
+	}
+}
+
+/*
+ * Opens the file to upload, and stores its size in 'len'.
+ *
+ * Returns the file descriptor, or -1 on error.
+ */
+static int
+file_open(const char *file, size_t *len)
+{
+	int	    fd;
+	struct stat sb;
+
+	if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		warn("%s", file);
+		if (fd != -1)
+			(void)close(fd);
+		return (-1);
+	}
+	if (sb.st_size > HTTP_FILESZ_LIMIT) {
+		warnx("'%s' exceeds file size-limit of %d MB", file,
+		    HTTP_FILESZ_LIMIT / (1024 * 1024));
+		(void)close(fd); return (-1);
+	}
+	*len = sb.st_size;
+
+	return (fd);
+}
+
+/*
+ * Maps the 'len' bytes of the file 'fd' into memory, and closes 'fd'. An
+ * empty file isn't mapped, and an empty string is returned.
+ *
+ * Returns the contents of the file, or NULL on error.
+ */
+static char *
+file_map(int fd, size_t len)
+{
+	void *p;
+
+	if (len == 0) {
+		(void)close(fd); return ("");
+	}
+	p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (p == MAP_FAILED) {
+		warn("mmap()"); return (NULL);
+	}
+	(void)madvise(p, len, MADV_SEQUENTIAL);
+
+	return (p);
+}
+
+static void
+file_unmap(char *p, size_t len)
+{
+	if (p != NULL && len > 0)
+		(void)munmap(p, len);
+}
+
+http_pool_t *
+http_pool_new(const char *host, u_short port)
+{
+	http_pool_t *pool;
+
+	if ((pool = malloc(sizeof(http_pool_t))) == NULL) {
+		warn("malloc()"); return (NULL);
+	}
+	if ((pool->host = strdup(host)) == NULL) {
+		warn("strdup()"); free(pool); return (NULL);
+	}
+	pool->h2    = NULL;
+	pool->noh2  = false;
+	pool->port  = port;
+	pool->nidle = 0;
+
+	return (pool);
+}
+
+/*
+ * Returns an idle connection from the pool, or a new connection if there
+ * is no usable idle connection.
+ */
+static ssl_conn_t *
+pool_idle(http_pool_t *pool)
+{
+	ssl_conn_t *cp;
+
+	while (pool->nidle > 0) {
+		cp = pool->idle[--pool->nidle];
+		if (ssl_alive(cp))
+			return (cp);
+		ssl_disconnect(cp);
+	}
+	return (NULL);
+}
+
+ssl_conn_t *
+http_pool_get(http_pool_t *pool)
+{
+	ssl_conn_t *cp;
+
+	if ((cp = pool_idle(pool)) != NULL)
+		return (cp);
+	/* Connect when the first request is sent. */
+	return (ssl_new(pool->host, pool->port));
+}
+
+/*
+ * Returns the connection to the pool. The unread rest of the last reply
+ * is skipped. Connections that can't be reused are closed.
+ */
+void
+http_pool_put(http_pool_t *pool, ssl_conn_t *cp)
+{
+	if (cp == NULL)
+		return;
+	if (!cp->keepalive || pool->nidle >= HTTP_POOL_SIZE ||
+	    ssl_drain(cp, HTTP_DRAIN_LIMIT) == -1) {
+		ssl_disconnect(cp); return;
+	}
+	pool->idle[pool->nidle++] = cp;
+}
+
+void
+http_pool_free(http_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+	while (pool->nidle > 0)
+		ssl_disconnect(pool->idle[--pool->nidle]);
+	h2_free(pool->h2);
+	free(pool->host);
+	free(pool);
+}
+
+/*
+ * Request engine
+ *
+ * http_run() processes a batch of requests on up to 'maxconns' parallel
+ * connections. The sockets are switched to non-blocking mode and driven
+ * by a single poll(2) loop, where SSL_ERROR_WANT_READ/WANT_WRITE merely
+ * change the events a connection waits for. Each connection is a little
+ * state machine: connect -> handshake -> send request -> receive reply ->
+ * next job. New connections are connected without blocking, so a slow
+ * connect doesn't hold up the other slots. Uploads wait for 100 Continue
+ * between their header and their body.
+ *
+ * A slot can also pipeline several requests: They are written
+ * back-to-back, and the replies are matched in order. Data read after
+ * the end of a reply is kept as the start of the next one.
+ */
+#define SLOT_CONNECT	1
+#define SLOT_HANDSHAKE	2
+#define SLOT_SEND	3
+#define SLOT_CONTINUE	4
+#define SLOT_RECV	5
+#define SLOT_BUFSZ	16384
+
+typedef struct http_slot_s {
+	int	   state;
+	int	   events;	/* poll(2) events the slot waits for. */
+	int	   npfd;	/* Number of the slot's poll(2) entries */
+	int	   status;	/* Status code, or -1 if not read yet. */
+	bool	   reused;	/* Connection served a request before. */
+	bool	   expect;	/* Waiting for 100 Continue */
+	long	   deadline;	/* End of the wait for 100 Continue in ms */
+	long	   hdrlen;	/* Length of the reply header, or -1 */
+	char	   *out;	/* Request header and body. */
+	char	   *body;	/* The job's file, mapped */
+	int	   fd;		/* The job's file for sendfile(), or -1 */
+	char	   *in;		/* Reply buffer */
+	char	   *zout;	/* Inflated body */
+	size_t	   outlen, outpos;
+	size_t	   bodylen, bodypos;
+	size_t	   insz, inlen;
+	size_t	   zsz, zlen;
+	size_t	   scan;	/* Start of the next unparsed header line. */
+	char	   *key;	/* Cache key of a GET request */
+	char	   *next;	/* Data read after the current reply */
+	size_t	   nextlen;
+	u_int	   id;		/* HTTP/2 stream */
+	int	   npipe;	/* Number of requests in 'out' */
+	int	   ipipe;	/* Index of the request being answered */
+	size_t	   ends[HTTP_PIPELINE_DEPTH]; /* End of each request in 'out' */
+	http_job_t *pipe[HTTP_PIPELINE_DEPTH];
+	ssl_conn_t *cp;
+	http_job_t *job;	/* pipe[ipipe] */
+	http_resp_t resp;
+	cache_entry_t  *ce;	/* Cached copy of the document */
+	http_decoder_t dc;
+} http_slot_t;
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static char *
+job_request(http_job_t *job, const char *host, const cache_entry_t *ce,
+	    size_t bodylen, size_t *len)
+{
+	http_req_t hdr;
+
+	(void)memset(&hdr, 0, sizeof(hdr));
+	hdr.ua	     = job->agent;
+	hdr.url	     = job->url;
+	hdr.type     = job->type;
+	hdr.host     = host;
+	hdr.cookie   = job->cookie;
+	hdr.accept   = job->accept;
+	hdr.location = job->url;
+	if (job->type == HTTP_RQ_TYPE_POST && job->file != NULL) {
+		hdr.ct = content_type(HTTP_POST_TYPE_OCTET);
+		hdr.cl = (int)bodylen;
+		hdr.expect = bodylen > HTTP_INLINE_BODY ? true : false;
+	} else if (job->type == HTTP_RQ_TYPE_POST) {
+		hdr.ct = content_type(job->ctype);
+		if ((hdr.body = job->content) != NULL)
+			hdr.cl = strlen(job->content);
+	}
+	if (ce != NULL) {
+		hdr.etag    = ce->etag;
+		hdr.lastmod = ce->lastmod;
+	}
+	return (http_gen_req(&hdr, len));
+}
+
+/*
+ * Requests that can be pipelined. GET requests are validated against the
+ * cache, and uploads wait for 100 Continue.
+ */
+static bool
+job_pipelinable(const http_job_t *job)
+{
+	return (job->type != HTTP_RQ_TYPE_GET && job->file == NULL);
+}
+
+/*
+ * Applies the retry policy to the attempt of the job that just ended. 'rp'
+ * is the reply, if any.
+ */
+static void
+job_retry(http_job_t *job, const http_resp_t *rp)
+{
+	job->retry = retry_delay(job->type != HTTP_RQ_TYPE_POST, job->tries++,
+	    job->status, job->error, rp);
+}
+
+/*
+ * Fails the job with the failure class 'error'. The callback isn't called
+ * if the job will be sent again.
+ */
+static void
+job_fail(http_job_t *job, int error)
+{
+	job->status = -1;
+	job->error  = error;
+	job->body   = NULL;
+	job->len    = 0;
+	job_retry(job, NULL);
+	if (job->retry < 0 && job->done != NULL)
+		job->done(job);
+}
+
+/*
+ * Passes a copy of the cached document to the job.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+job_cached(http_job_t *job, const cache_entry_t *ce)
+{
+	free(job->body);
+	if ((job->body = malloc(ce->len + 1)) == NULL) {
+		warn("malloc()"); return (-1);
+	}
+	(void)memcpy(job->body, ce->data, ce->len);
+	job->body[ce->len] = '\0';
+	job->len = ce->len;
+
+	return (0);
+}
+
+/*
+ * Uses the cached document if the server replied with 304, and stores
+ * the body of a 200 reply in the cache.
+ */
+static int
+slot_cache(http_slot_t *sp, int status)
+{
+	http_job_t *job = sp->job;
+
+	if (status == HTTP_NOT_MODIFIED && sp->ce != NULL) {
+		cache_entry_touch(sp->key);
+		return (job_cached(job, sp->ce) == -1 ? -1 : HTTP_OK);
+	}
+	if (status == HTTP_OK && job->body != NULL &&
+	    cache_storable(&sp->resp)) {
+		(void)cache_entry_put(sp->key, sp->resp.field[HTTP_F_ETAG],
+		    sp->resp.field[HTTP_F_LAST_MODIFIED], job->body,
+		    job->len);
+	}
+	return (status);
+}
+
+/*
+ * Frees what the slot holds for its current job.
+ */
+static void
+slot_clear(http_slot_t *sp)
+{
+	free(sp->key); sp->key = NULL;
+	cache_entry_free(sp->ce); sp->ce = NULL;
+	free(sp->out); sp->out = NULL;
+	file_unmap(sp->body, sp->bodylen); sp->body = NULL;
+	if (sp->fd != -1) {
+		(void)close(sp->fd); sp->fd = -1;
+	}
+	free(sp->zout); sp->zout = NULL;
+	decoder_end(&sp->dc);
+	resp_clear(&sp->resp);
+}
+
+static void
+slot_finish(http_slot_t *sp, int status)
+{
+	http_job_t *job;
+
+	job = sp->job;
+	if (sp->key != NULL)
+		status = slot_cache(sp, status);
+	job->status = status;
+	job_retry(job, &sp->resp);
+	slot_clear(sp);
+	if (status == -1 && sp->cp != NULL) {
+		ssl_disconnect(sp->cp); sp->cp = NULL;
+	}
+	sp->job = NULL;
+	if (job->retry < 0 && job->done != NULL)
+		job->done(job);
+	if (status == -1) {
+		/* The replies to the rest of the pipeline are lost. */
+		while (++sp->ipipe < sp->npipe)
+			job_fail(sp->pipe[sp->ipipe], job->error);
+	}
+}
+
+/*
+ * Prepares the slot for the reply to 'job'.
+ */
+static void
+slot_init(http_slot_t *sp, http_job_t *job)
+{
+	sp->job	   = job;
+	sp->fd	   = -1;
+	sp->expect = false;
+	sp->status = sp->hdrlen = -1;
+	sp->inlen  = sp->scan = 0;
+	sp->zsz	   = sp->zlen = 0;
+	job->body  = NULL;
+	job->len   = 0;
+	job->error = SSL_ERR_NONE;
+	(void)memset(&sp->dc, 0, sizeof(sp->dc));
+}
+
+/*
+ * Sets the slot up to send its requests on its own connection, an idle
+ * connection from the pool, or a new one.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+slot_connect(http_slot_t *sp, http_pool_t *pool)
+{
+	if (sp->cp == NULL && (sp->cp = pool_idle(pool)) == NULL &&
+	    (sp->cp = ssl_open(pool->host, pool->port)) == NULL) {
+		sp->job->error = ssl_error;
+		slot_finish(sp, -1); return (-1);
+	}
+	sp->reused = sp->cp->nreq > 0 ? true : false;
+	http_begin(sp->cp);
+	if (sp->cp->state == SSL_STATE_CONNECTING) {
+		sp->state = SLOT_CONNECT; return (0);
+	}
+	if (ssl_set_nonblock(sp->cp, true) == -1) {
+		slot_finish(sp, -1); return (-1);
+	}
+	sp->state = sp->cp->state == SSL_STATE_HANDSHAKE ? SLOT_HANDSHAKE :
+		    SLOT_SEND;
+
+	return (0);
+}
+
+/*
+ * Assigns 'job' to the slot, and answers GET requests from the cache if
+ * the cached copy is fresh.
+ *
+ * Returns 0 if the request must be sent, 1 if the job was answered from
+ * the cache, and -1 on error.
+ */
+static int
+slot_prepare(http_slot_t *sp, http_pool_t *pool, http_job_t *job)
+{
+	int  status;
+	bool fresh;
+
+	slot_init(sp, job);
+	sp->pipe[0] = job;
+	sp->npipe   = 1;
+	sp->ipipe   = 0;
+	sp->outpos  = sp->nextlen = 0;
+
+	free(sp->key); cache_entry_free(sp->ce);
+	sp->key = NULL; sp->ce = NULL;
+	if (job->type == HTTP_RQ_TYPE_GET) {
+		sp->ce = cache_lookup(pool->host, job->url, job->cookie,
+		    job->accept, &sp->key, &fresh);
+		if (fresh) {
+			status = job_cached(job, sp->ce) == -1 ? -1 : HTTP_OK;
+			cache_entry_free(sp->ce); sp->ce = NULL;
+			free(sp->key); sp->key = NULL;
+			slot_finish(sp, status);
+			return (1);
+		}
+	}
+	if (http_offline) {
+		if (job->type != HTTP_RQ_TYPE_GET)
+			warnx("Not connecting to %s in offline mode",
+			    pool->host);
+		slot_finish(sp, -1); return (-1);
+	}
+	sp->bodylen = sp->bodypos = 0;
+
+	return (0);
+}
+
+/*
+ * Starts the job 'job' on the slot.
+ *
+ * Returns 0 if the request was started, 1 if the job was answered from
+ * the cache, and -1 on error.
+ */
+static int
+slot_start(http_slot_t *sp, http_pool_t *pool, http_job_t *job)
+{
+	int fd, ret;
+
+	if ((ret = slot_prepare(sp, pool, job)) != 0)
+		return (ret);
+	if (job->type == HTTP_RQ_TYPE_POST && job->file != NULL) {
+		if ((fd = file_open(job->file, &sp->bodylen)) == -1) {
+			slot_finish(sp, -1); return (-1);
+		}
+		/*
+		 * With kernel TLS, the file is sent with sendfile() once
+		 * the connection is up. slot_step() maps it if the
+		 * connection doesn't support it.
+		 */
+		if (ssl_ktls && sp->bodylen > 0)
+			sp->fd = fd;
+		else if ((sp->body = file_map(fd, sp->bodylen)) == NULL) {
+			slot_finish(sp, -1); return (-1);
+		}
+	}
+	sp->expect = job->file != NULL && sp->bodylen > HTTP_INLINE_BODY ?
+	    true : false;
+	sp->out = job_request(job, pool->host, sp->ce, sp->bodylen,
+	    &sp->outlen);
+	if (sp->out == NULL) {
+		slot_finish(sp, -1); return (-1);
+	}
+	return (slot_connect(sp, pool));
+}
+
+/*
+ * Starts the 'n' jobs in 'pipe' on the slot, and pipelines their requests
+ * on one connection.
+ *
+ * Returns 0 if the requests were started, and -1 on error.
+ */
+static int
+slot_pipeline(http_slot_t *sp, http_pool_t *pool, http_job_t **pipe, int n)
+{
+	int    i;
+	char   *rq, *p;
+	size_t len;
+
+	(void)memmove(sp->pipe, pipe, n * sizeof(http_job_t *));
+	sp->npipe = n;
+	sp->ipipe = 0;
+	slot_init(sp, sp->pipe[0]);
+	free(sp->out); sp->out = NULL;
+	sp->outpos = sp->outlen = sp->nextlen = 0;
+	sp->bodylen = sp->bodypos = 0;
+
+	if (http_offline) {
+		warnx("Not connecting to %s in offline mode", pool->host);
+		slot_finish(sp, -1); return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		rq = job_request(sp->pipe[i], pool->host, NULL, 0, &len);
+		if (rq == NULL) {
+			slot_finish(sp, -1); return (-1);
+		}
+		if ((p = realloc(sp->out, sp->outlen + len)) == NULL) {
+			warn("realloc()"); free(rq);
+			slot_finish(sp, -1); return (-1);
+		}
+		(void)memcpy(p + sp->outlen, rq, len);
+		free(rq);
+		sp->out	    = p;
+		sp->outlen += len;
+		sp->ends[i] = sp->outlen;
+	}
+	return (slot_connect(sp, pool));
+}
+
+/*
+ * Called if the connection of a pipeline failed. Requests that weren't
+ * sent completely, and idempotent requests are sent again on a new
+ * connection. The other unanswered requests might have been processed,
+ * so they fail rather than being sent twice. Nothing is sent again if a
+ * new connection failed before any reply arrived.
+ */
+static void
+pipe_error(http_slot_t *sp, http_pool_t *pool)
+{
+	int	   i, n;
+	bool	   retry;
+	http_job_t *job;
+
+	retry = sp->reused || sp->ipipe > 0 ? true : false;
+	slot_clear(sp);
+	ssl_disconnect(sp->cp); sp->cp = NULL;
+	sp->job = NULL;
+	for (i = sp->ipipe, n = 0; i < sp->npipe; i++) {
+		job = sp->pipe[i];
+		if (retry && (job->type != HTTP_RQ_TYPE_POST ||
+		    sp->outpos < sp->ends[i]))
+			sp->pipe[n++] = job;
+		else
+			job_fail(job, SSL_ERR_IO);
+	}
+	sp->npipe = sp->ipipe = 0;
+	if (n > 0)
+		(void)slot_pipeline(sp, pool, sp->pipe, n);
+}
+
+/*
+ * Called if the connection failed. An idempotent request that failed on a
+ * reused connection before any reply arrived is retried on a new one.
+ */
+static void
+slot_error(http_slot_t *sp, http_pool_t *pool)
+{
+	http_job_t *job;
+
+	if (sp->npipe > 1) {
+		pipe_error(sp, pool); return;
+	}
+	sp->job->error = SSL_ERR_IO;
+	if (!sp->reused || sp->inlen > 0 || sp->job->type == HTTP_RQ_TYPE_POST) {
+		slot_finish(sp, -1); return;
+	}
+	job = sp->job;
+	free(sp->out); sp->out = NULL;
+	ssl_disconnect(sp->cp);
+	sp->cp = ssl_open(pool->host, pool->port);
+	if (sp->cp == NULL) {
+		job->error = ssl_error;
+		slot_finish(sp, -1); return;
+	}
+	(void)slot_start(sp, pool, job);
+}
+
+/*
+ * Hands the reply body over to the job.
+ *
+ * Returns 0 on success, and -1 if the compressed body is incomplete.
+ */
+static int
+slot_reply(http_slot_t *sp)
+{
+	size_t len;
+
+	if (sp->dc.inflate) {
+		if (!sp->dc.zend) {
+			warnx("Incomplete compressed reply"); return (-1);
+		}
+		sp->job->body = sp->zout;
+		sp->job->len  = sp->zlen;
+		sp->zout      = NULL;
+	} else {
+		len = sp->inlen - sp->hdrlen;
+		(void)memmove(sp->in, sp->in + sp->hdrlen, len);
+		sp->in[len]   = '\0';
+		sp->job->body = sp->in;
+		sp->job->len  = len;
+		sp->in	      = NULL;
+		sp->insz      = 0;
+	}
+	return (0);
+}
+
+/*
+ * Hands the reply body over to the job. The connection stays open if the
+ * server allows it, and the end of the reply was marked by a
+ * Content-Length or the last chunk.
+ */
+static void
+slot_complete(http_slot_t *sp)
+{
+	if (slot_reply(sp) == -1) {
+		slot_finish(sp, -1); return;
+	}
+	if (sp->nextlen > 0 && sp->ipipe + 1 >= sp->npipe) {
+		/* Garbage after the last reply. */
+		sp->nextlen = 0; sp->resp.keepalive = false;
+	}
+	sp->cp->keepalive = sp->resp.keepalive ? 1 : 0;
+	ssl_set_limit(sp->cp, 0);
+	if (!sp->cp->keepalive) {
+		ssl_disconnect(sp->cp); sp->cp = NULL;
+	}
+	slot_finish(sp, sp->status);
+}
+
+/*
+ * Inflates the 'len' bytes at 'p' into the slot's output buffer.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+slot_inflate(http_slot_t *sp, char *p, size_t len)
+{
+	int    n;
+	char   *q;
+	size_t sz;
+
+	sp->dc.z.next_in  = (Bytef *)p;
+	sp->dc.z.avail_in = len;
+	while (sp->dc.z.avail_in > 0 && !sp->dc.zend) {
+		if (sp->zsz - sp->zlen < SLOT_BUFSZ / 4) {
+			sz = sp->zsz > 0 ? sp->zsz * 2 : SLOT_BUFSZ * 4;
+			if ((q = realloc(sp->zout, sz)) == NULL) {
+				warn("realloc()"); return (-1);
+			}
+			sp->zout = q; sp->zsz = sz;
+		}
+		n = decoder_inflate(&sp->dc, sp->zout + sp->zlen,
+		    sp->zsz - sp->zlen - 1);
+		if (n == -1)
+			return (-1);
+		sp->zlen += n;
+		sp->zout[sp->zlen] = '\0';
+	}
+	return (0);
+}
+
+/*
+ * Keeps the 'len' bytes at 'p' read after the end of the reply.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+slot_keep(http_slot_t *sp, const char *p, size_t len)
+{
+	char *q;
+
+	if ((q = realloc(sp->next, sp->nextlen + len)) == NULL) {
+		warn("realloc()"); return (-1);
+	}
+	(void)memcpy(q + sp->nextlen, p, len);
+	sp->next     = q;
+	sp->nextlen += len;
+
+	return (0);
+}
+
+/*
+ * Appends the 'len' bytes of body data at 'p' to the reply. 'p' must
+ * point to the end of the reply buffer. Chunked data is decoded in place,
+ * and compressed data is inflated while it arrives.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+slot_body(http_slot_t *sp, char *p, size_t len)
+{
+	long   used;
+	size_t n, rd;
+
+	rd = p - sp->in - sp->hdrlen;
+	if (!sp->dc.chunked && sp->resp.clen >= 0 &&
+	    rd + len > (size_t)sp->resp.clen) {
+		n = sp->resp.clen - rd;
+		if (slot_keep(sp, p + n, len - n) == -1)
+			return (-1);
+		len = n;
+	}
+	if ((used = decoder_dechunk(&sp->dc, p, len, &n)) == -1)
+		return (-1);
+	if (sp->dc.chunked && sp->dc.ch.state == HTTP_CHUNK_DONE &&
+	    (size_t)used < len &&
+	    slot_keep(sp, p + used, len - used) == -1)
+		return (-1);
+	sp->inlen = p - sp->in + n;
+	if (sp->dc.inflate)
+		return (slot_inflate(sp, p, n));
+	return (0);
+}
+
+static bool
+slot_done(http_slot_t *sp)
+{
+	if (sp->hdrlen < 0)
+		return (false);
+	if (sp->dc.chunked)
+		return (sp->dc.ch.state == HTTP_CHUNK_DONE);
+	return (sp->resp.clen >= 0 &&
+	    sp->inlen - sp->hdrlen >= (size_t)sp->resp.clen);
+}
+
+/*
+ * Parses the header lines received so far.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+slot_parse(http_slot_t *sp)
+{
+	char   *ln, *nl;
+	size_t len;
+
+	while (sp->hdrlen < 0 && sp->scan < sp->inlen) {
+		ln = sp->in + sp->scan;
+		if ((nl = memchr(ln, '\n', sp->inlen - sp->scan)) == NULL)
+			break;
+		*nl = '\0';
+		if (nl > ln && nl[-1] == '\r')
+			nl[-1] = '\0';
+		sp->scan = nl - sp->in + 1;
+		if (sp->status == -1) {
+			if (strncmp(ln, "HTTP/", 5) != 0)
+				continue;
+			if ((sp->status = http_status(ln, &sp->resp)) == -1)
+				return (-1);
+		} else if (*ln == '\0') {
+			if (sp->status >= 100 && sp->status < 200) {
+				/* Skip interim reply (1xx). */
+				sp->status = -1;
+				sp->expect = false;
+				continue;
+			}
+			sp->hdrlen = sp->scan;
+			http_header_end(&sp->resp);
+			if (decoder_init(&sp->dc, &sp->resp) == -1)
+				return (-1);
+			/* Body data read along with the header. */
+			len = sp->inlen - sp->hdrlen;
+			sp->inlen = sp->hdrlen;
+			return (slot_body(sp, sp->in + sp->hdrlen, len));
+		} else if (http_header(ln, &sp->resp) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Grows the reply buffer, so it has room for at least 'need' more bytes
+ * plus the terminating '\0'.
+ */
+static int
+slot_grow(http_slot_t *sp, size_t need)
+{
+	char   *p;
+	size_t sz;
+
+	if (sp->inlen + need < sp->insz)
+		return (0);
+	for (sz = sp->insz > 0 ? sp->insz : SLOT_BUFSZ;
+	    sz < sp->inlen + need + 1; sz *= 2)
+		;
+	if ((p = realloc(sp->in, sz)) == NULL) {
+		warn("realloc()"); return (-1);
+	}
+	sp->in = p; sp->insz = sz;
+
+	return (0);
+}
+
+/*
+ * Moves on to the reply to the next request of the pipeline, if any.
+ * The data read after the last reply is the start of it.
+ */
+static void
+slot_next(http_slot_t *sp, http_pool_t *pool)
+{
+	size_t len;
+
+	if (++sp->ipipe >= sp->npipe)
+		return;
+	if (sp->cp == NULL) {
+		/* The server didn't process the rest. Send it again. */
+		(void)slot_pipeline(sp, pool, sp->pipe + sp->ipipe,
+		    sp->npipe - sp->ipipe);
+		return;
+	}
+	slot_init(sp, sp->pipe[sp->ipipe]);
+	sp->state = SLOT_RECV;
+	if ((len = sp->nextlen) == 0)
+		return;
+	sp->nextlen = 0;
+	if (slot_grow(sp, len) == -1) {
+		slot_finish(sp, -1); return;
+	}
+	(void)memcpy(sp->in, sp->next, len);
+	sp->inlen = len;
+	if (slot_parse(sp) == -1)
+		slot_finish(sp, -1);
+}
+
+/*
+ * Advances the slot's state machine until it would block.
+ */
+static void
+slot_step(http_slot_t *sp, http_pool_t *pool)
+{
+	int    n;
+	long   need;
+	char   *p;
+	size_t len;
+
+	while (sp->job != NULL) {
+		switch (sp->state) {
+		case SLOT_CONNECT:
+			if ((n = ssl_connecting(sp->cp)) == 0) {
+				sp->events = POLLOUT;
+				return;
+			} else if (n == -1) {
+				sp->job->error = ssl_error;
+				slot_finish(sp, -1); return;
+			}
+			if (ssl_set_nonblock(sp->cp, true) == -1) {
+				slot_finish(sp, -1); return;
+			}
+			sp->state = SLOT_HANDSHAKE;
+			break;
+		case SLOT_HANDSHAKE:
+			if ((n = ssl_handshake(sp->cp)) == 0) {
+				sp->events = ssl_events(sp->cp, -1);
+				return;
+			} else if (n == -1) {
+				sp->job->error = SSL_ERR_TLS;
+				slot_finish(sp, -1); return;
+			}
+			sp->state = SLOT_SEND;
+			break;
+		case SLOT_SEND:
+			if (sp->fd != -1 && !ssl_ktls_send(sp->cp)) {
+				/* No kernel TLS on this connection. */
+				sp->body = file_map(sp->fd, sp->bodylen);
+				sp->fd = -1;
+				if (sp->body == NULL) {
+					slot_finish(sp, -1); return;
+				}
+			}
+			/* The request, then the file, one record at a time. */
+			if (sp->outpos < sp->outlen) {
+				p   = sp->out + sp->outpos;
+				len = sp->outlen - sp->outpos;
+			} else if (sp->fd != -1) {
+				p   = NULL;
+				len = sp->bodylen - sp->bodypos;
+			} else {
+				p   = sp->body + sp->bodypos;
+				len = sp->bodylen - sp->bodypos;
+			}
+			if (p == NULL) {
+				n = (int)ssl_sendfile(sp->cp, sp->fd,
+				    (off_t)sp->bodypos, len);
+			} else {
+				n = SSL_write(sp->cp->handle, p,
+				    len > SSL_RECORD_SIZE ? SSL_RECORD_SIZE :
+				    len);
+			}
+			if (n <= 0) {
+				if ((sp->events = ssl_events(sp->cp, n)) != -1)
+					return;
+				slot_error(sp, pool);
+				break;
+			}
+			if (sp->outpos < sp->outlen) {
+				if ((sp->outpos += n) == sp->outlen &&
+				    sp->expect) {
+					sp->deadline = now_ms() +
+					    HTTP_EXPECT_TIMEOUT;
+					sp->state = SLOT_CONTINUE;
+					break;
+				}
+			} else
+				sp->bodypos += n;
+			if (sp->outpos == sp->outlen &&
+			    sp->bodypos == sp->bodylen)
+				sp->state = SLOT_RECV;
+			break;
+		case SLOT_CONTINUE:
+			if (now_ms() >= sp->deadline) {
+				/* No answer. The server ignores Expect. */
+				sp->expect = false;
+				sp->state  = SLOT_SEND;
+				break;
+			}
+			if (slot_grow(sp, SLOT_BUFSZ / 4) == -1) {
+				slot_finish(sp, -1); return;
+			}
+			n = SSL_read(sp->cp->handle, sp->in + sp->inlen,
+			    sp->insz - sp->inlen - 1);
+			if (n <= 0) {
+				if ((sp->events = ssl_events(sp->cp, n)) != -1)
+					return;
+				sp->job->error = SSL_ERR_IO;
+				slot_finish(sp, -1); return;
+			}
+			sp->inlen += n;
+			if (slot_parse(sp) == -1) {
+				slot_finish(sp, -1); return;
+			}
+			if (sp->hdrlen >= 0) {
+				/* Refused. The body was never sent. */
+				sp->resp.keepalive = false;
+				sp->state = SLOT_RECV;
+			} else if (!sp->expect)
+				sp->state = SLOT_SEND;
+			break;
+		case SLOT_RECV:
+			if (slot_done(sp)) {
+				slot_complete(sp);
+				slot_next(sp, pool);
+				break;
+			}
+			need = SLOT_BUFSZ / 4;
+			if (sp->hdrlen >= 0 && sp->resp.clen >= 0)
+				need = sp->hdrlen + sp->resp.clen - sp->inlen;
+			if (slot_grow(sp, need) == -1) {
+				slot_finish(sp, -1); return;
+			}
+			n = SSL_read(sp->cp->handle, sp->in + sp->inlen,
+			    sp->insz - sp->inlen - 1);
+			if (n > 0) {
+				if (sp->hdrlen >= 0)
+					n = slot_body(sp, sp->in + sp->inlen, n);
+				else {
+					sp->inlen += n;
+					n = slot_parse(sp);
+				}
+				if (n == -1)
+					slot_finish(sp, -1);
+				break;
+			}
+			if ((sp->events = ssl_events(sp->cp, n)) != -1)
+				return;
+			/* EOF or error */
+			sp->resp.keepalive = false;
+			sp->job->error = SSL_ERR_IO;
+			if (sp->hdrlen >= 0 && sp->resp.clen < 0 &&
+			    !sp->dc.chunked) {
+				slot_complete(sp);
+				slot_next(sp, pool);
+			} else if (sp->inlen == 0 || sp->npipe > 1)
+				slot_error(sp, pool);
+			else {
+				warnx("Connection closed by %s", pool->host);
+				slot_finish(sp, -1);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Processes the 'njobs' requests in 'jobs' on up to 'maxconns' parallel
+ * connections from 'pool', pipelining up to 'depth' consecutive requests
+ * per connection.
+ */
+static int
+run_jobs(http_pool_t *pool, http_job_t **jobs, int njobs, int maxconns,
+	 int depth)
+{
+	int	      i, n, next, nactive, npfd, ret, wait, error;
+	bool	      timed;
+	long	      now;
+	http_job_t    *pipe[HTTP_PIPELINE_DEPTH];
+	http_slot_t   *slots;
+	struct pollfd *pfd;
+
+	if (depth > HTTP_PIPELINE_DEPTH)
+		depth = HTTP_PIPELINE_DEPTH;
+	if (maxconns > njobs)
+		maxconns = njobs;
+	if (maxconns < 1)
+		return (0);
+	slots = calloc(maxconns, sizeof(http_slot_t));
+	/* A connecting slot polls the sockets of all its attempts. */
+	pfd   = calloc(maxconns * DNS_MAX_ADDRS, sizeof(struct pollfd));
+	if (slots == NULL || pfd == NULL) {
+		warn("calloc()"); free(slots); free(pfd); return (-1);
+	}
+	for (ret = next = 0;;) {
+		for (i = 0; i < maxconns; i++) {
+			while (slots[i].job == NULL && next < njobs) {
+				for (n = 0; n < depth && next + n < njobs &&
+				    job_pipelinable(jobs[next + n]); n++)
+					pipe[n] = jobs[next + n];
+				if (n > 1) {
+					next += n;
+					n = slot_pipeline(&slots[i], pool,
+					    pipe, n);
+				} else
+					n = slot_start(&slots[i], pool,
+					    jobs[next++]);
+				if (n == 0)
+					slot_step(&slots[i], pool);
+			}
+		}
+		now  = now_ms();
+		wait  = ssl_time_left(SSL_IO_TIMEOUT * 1000);
+		timed = false;
+		for (i = nactive = npfd = 0; i < maxconns; i++) {
+			if (slots[i].job == NULL)
+				continue;
+			nactive++;
+			if (slots[i].state == SLOT_CONNECT) {
+				/* Wait for the attempts, or the next one. */
+				slots[i].npfd = ssl_connect_fds(slots[i].cp,
+				    &pfd[npfd]);
+				npfd += slots[i].npfd;
+				n = ssl_connect_wait(slots[i].cp);
+				if (n < wait) {
+					wait = n; timed = true;
+				}
+				continue;
+			}
+			if (slots[i].state == SLOT_CONTINUE &&
+			    slots[i].deadline - now < wait) {
+				/* The wait ends with that for 100 Continue. */
+				wait = slots[i].deadline > now ?
+				    (int)(slots[i].deadline - now) : 0;
+				timed = true;
+			}
+			pfd[npfd].fd	  = slots[i].cp->sock;
+			pfd[npfd].events  = slots[i].events;
+			pfd[npfd].revents = 0;
+			slots[i].npfd	  = 1;
+			npfd++;
+		}
+		if (nactive == 0)
+			break;
+		while ((n = poll(pfd, npfd, wait)) == -1) {
+			if (errno != EINTR) {
+				warn("poll()"); break;
+			}
+		}
+		/*
+		 * A timeout is only fatal if no slot waited for 100 Continue
+		 * or its next connection attempt.
+		 */
+		if (n == -1 || (n == 0 && (!timed || ssl_expired()))) {
+			if (n == 0 && ssl_error != SSL_ERR_DEADLINE) {
+				warnx("http_run(): Timeout");
+				ssl_error = SSL_ERR_TIMEOUT;
+			}
+			error = n == 0 ? ssl_error : SSL_ERR_NONE;
+			for (i = 0; i < maxconns; i++) {
+				if (slots[i].job == NULL)
+					continue;
+				slots[i].job->error = error;
+				slot_finish(&slots[i], -1);
+			}
+			for (; next < njobs; next++)
+				job_fail(jobs[next], error);
+			ret = n == 0 ? 0 : -1;
+			break;
+		}
+		for (i = npfd = 0, now = now_ms(); i < maxconns; i++) {
+			if (slots[i].job == NULL)
+				continue;
+			for (n = 0; n < slots[i].npfd &&
+			    pfd[npfd + n].revents == 0; n++)
+				;
+			npfd += slots[i].npfd;
+			if (n < slots[i].npfd ||
+			    slots[i].state == SLOT_CONNECT ||
+			    (slots[i].state == SLOT_CONTINUE &&
+			    now >= slots[i].deadline))
+				slot_step(&slots[i], pool);
+		}
+	}
+	for (i = 0; i < maxconns; i++) {
+		free(slots[i].in);
+		free(slots[i].next);
+		if (slots[i].cp == NULL)
+			continue;
+		if (ssl_set_nonblock(slots[i].cp, false) == -1)
+			slots[i].cp->keepalive = 0;
+		http_pool_put(pool, slots[i].cp);
+	}
+	free(slots); free(pfd);
+
+	return (ret);
+}
+
+/*
+ * HTTP/2
+ *
+ * If enabled by http_h2, and the server selects "h2" by ALPN, a batch
+ * runs as concurrent streams of one connection. Each stream has a slot
+ * like an HTTP/1.1 connection, but the frames are read and written by
+ * h2.c, which reports the header fields and data of the streams through
+ * the callbacks below. The connection stays in the pool for the next
+ * batch.
+ */
+typedef struct http_h2run_s {
+	int	    nretry;
+	int	    retries;	/* Refused streams we may send again */
+	int	    answered;	/* Streams answered on the connection */
+	bool	    reused;	/* Connection came from the pool */
+	const char  *host;
+	h2_conn_t   *h2;
+	http_slot_t *slots;	/* H2_MAX_STREAMS slots */
+	http_job_t  **retry;	/* Jobs refused by the server */
+} http_h2run_t;
+
+static http_slot_t *
+stream_slot(http_h2run_t *rp, u_int id)
+{
+	int i;
+
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (rp->slots[i].job != NULL && rp->slots[i].id == id)
+			return (&rp->slots[i]);
+	}
+	return (NULL);
+}
+
+static void
+stream_fail(http_h2run_t *rp, http_slot_t *sp)
+{
+	h2_cancel(rp->h2, sp->id);
+	slot_finish(sp, -1);
+}
+
+static void
+stream_header(void *arg, u_int id, const char *name, const char *value)
+{
+	char	    *ln;
+	size_t	    len;
+	http_slot_t *sp;
+
+	/* Fields after the final header are trailers. */
+	if ((sp = stream_slot(arg, id)) == NULL || sp->hdrlen >= 0)
+		return;
+	if (strcmp(name, ":status") == 0) {
+		resp_clear(&sp->resp);
+		sp->status = sp->resp.status = (int)strtol(value, NULL, 10);
+		return;
+	} else if (*name == ':')
+		return;
+	len = strlen(name) + strlen(value) + 3;
+	if ((ln = malloc(len)) == NULL) {
+		warn("malloc()"); stream_fail(arg, sp); return;
+	}
+	(void)snprintf(ln, len, "%s: %s", name, value);
+	if (http_header(ln, &sp->resp) == -1)
+		stream_fail(arg, sp);
+	free(ln);
+}
+
+static void
+stream_headers_end(void *arg, u_int id)
+{
+	http_slot_t *sp;
+
+	if ((sp = stream_slot(arg, id)) == NULL || sp->hdrlen >= 0)
+		return;
+	if (sp->status < 200) {
+		/* Skip interim reply (1xx). */
+		sp->status = -1; return;
+	}
+	sp->hdrlen = 0;
+	sp->resp.chunked = false;
+	http_header_end(&sp->resp);
+	if (decoder_init(&sp->dc, &sp->resp) == -1 || slot_grow(sp, 0) == -1)
+		stream_fail(arg, sp);
+}
+
+static void
+stream_data(void *arg, u_int id, const char *p, size_t len)
+{
+	http_slot_t *sp;
+
+	if ((sp = stream_slot(arg, id)) == NULL)
+		return;
+	if (sp->hdrlen < 0) {
+		warnx("HTTP/2: Data before header");
+		stream_fail(arg, sp); return;
+	}
+	if (slot_grow(sp, len) == -1) {
+		stream_fail(arg, sp); return;
+	}
+	(void)memcpy(sp->in + sp->inlen, p, len);
+	if (slot_body(sp, sp->in + sp->inlen, len) == -1)
+		stream_fail(arg, sp);
+}
+
+static void
+stream_close(void *arg, u_int id, u_int error)
+{
+	http_slot_t  *sp;
+	http_h2run_t *rp = arg;
+
+	if ((sp = stream_slot(rp, id)) == NULL)
+		return;
+	if (error == H2_REFUSED_STREAM && rp->retries > 0) {
+		/* Not processed. Send it again later. */
+		rp->retries--;
+		rp->retry[rp->nretry++] = sp->job;
+		slot_clear(sp);
+		sp->job = NULL;
+		return;
+	}
+	rp->answered++;
+	if (error != H2_NO_ERROR)
+		warnx("HTTP/2: Stream reset by %s (error %u)", rp->host, error);
+	else if (sp->hdrlen < 0 || (!sp->dc.inflate && sp->resp.clen >= 0 &&
+	    sp->inlen < (size_t)sp->resp.clen))
+		warnx("Incomplete reply from %s", rp->host);
+	else if (slot_reply(sp) == 0) {
+		sp->nextlen = 0;
+		slot_finish(sp, sp->status);
+		return;
+	}
+	sp->job->error = SSL_ERR_IO;
+	slot_finish(sp, -1);
+}
+
+static const h2_ops_t stream_ops = {
+	stream_header, stream_headers_end, stream_data, stream_close
+};
+
+/*
+ * Sends the request of the slot's job as a new stream. The body follows
+ * in stream_send().
+ *
+ * Returns 0 on success, and -1 if the connection can't be used anymore.
+ */
+static int
+stream_start(http_h2run_t *rp, http_slot_t *sp)
+{
+	int	   fd, id, n;
+	char	   cl[24];
+	h2_field_t f[16];
+	http_job_t *job = sp->job;
+
+	if (job->type == HTTP_RQ_TYPE_POST && job->file != NULL) {
+		if ((fd = file_open(job->file, &sp->bodylen)) == -1 ||
+		    (sp->body = file_map(fd, sp->bodylen)) == NULL) {
+			slot_finish(sp, -1); return (0);
+		}
+	} else if (job->type == HTTP_RQ_TYPE_POST && job->content != NULL)
+		sp->bodylen = strlen(job->content);
+	n = 0;
+	f[n].name = ":method";
+	f[n++].value = job->type == HTTP_RQ_TYPE_GET ? "GET" :
+	    job->type == HTTP_RQ_TYPE_POST ? "POST" : "DELETE";
+	f[n].name = ":scheme";	  f[n++].value = "https";
+	f[n].name = ":authority"; f[n++].value = rp->host;
+	f[n].name = ":path";	  f[n++].value = job->url;
+	if (job->type == HTTP_RQ_TYPE_GET) {
+		f[n].name = "x-requested-with";
+		f[n++].value = "XMLHttpRequest";
+	}
+	if (job->agent != NULL) {
+		f[n].name = "user-agent"; f[n++].value = job->agent;
+	}
+	if (job->cookie != NULL) {
+		f[n].name = "cookie"; f[n++].value = job->cookie;
+	}
+	if (job->accept != NULL) {
+		f[n].name = "accept"; f[n++].value = job->accept;
+	}
+	if (job->type == HTTP_RQ_TYPE_POST) {
+		f[n].name = "content-type";
+		f[n++].value = content_type(job->file != NULL ?
+		    HTTP_POST_TYPE_OCTET : job->ctype);
+		(void)snprintf(cl, sizeof(cl), "%lu", (u_long)sp->bodylen);
+		f[n].name = "content-length"; f[n++].value = cl;
+	}
+	if (sp->ce != NULL && sp->ce->etag != NULL) {
+		f[n].name = "if-none-match"; f[n++].value = sp->ce->etag;
+	}
+	if (sp->ce != NULL && sp->ce->lastmod != NULL) {
+		f[n].name = "if-modified-since"; f[n++].value = sp->ce->lastmod;
+	}
+	f[n].name = "accept-encoding"; f[n++].value = "gzip, deflate";
+	f[n].name = "cache-control";   f[n++].value = "no-cache";
+
+	if ((id = h2_request(rp->h2, f, n, sp->bodylen == 0)) == -1) {
+		slot_finish(sp, -1); return (-1);
+	}
+	sp->id = (u_int)id;
+
+	return (0);
+}
+
+/*
+ * Queues as much of the request body as the flow control allows.
+ */
+static int
+stream_send(http_h2run_t *rp, http_slot_t *sp)
+{
+	long	   n;
+	const char *p;
+
+	p = sp->job->file != NULL ? sp->body : sp->job->content;
+	while (sp->bodypos < sp->bodylen) {
+		n = h2_send_data(rp->h2, sp->id, p + sp->bodypos,
+		    sp->bodylen - sp->bodypos, true);
+		if (n <= 0)
+			return ((int)n);
+		sp->bodypos += n;
+	}
+	return (0);
+}
+
+/*
+ * Returns the pool's HTTP/2 connection, or connects and offers "h2" by
+ * ALPN. If the server selects HTTP/1.1, the new connection goes to the
+ * idle pool, and the pool sticks to HTTP/1.1.
+ */
+static h2_conn_t *
+pool_h2(http_pool_t *pool, bool *reused)
+{
+	h2_conn_t  *h2;
+	ssl_conn_t *cp;
+
+	if ((h2 = pool->h2) != NULL) {
+		pool->h2 = NULL;
+		if (h2_input(h2) == 0 && h2_can_open(h2)) {
+			*reused = true;
+			return (h2);
+		}
+		h2_free(h2);
+	}
+	*reused = false;
+	if ((cp = ssl_connect_opts(pool->host, pool->port, SSL_OPT_H2)) == NULL)
+		return (NULL);
+	if (!ssl_alpn_is(cp, "h2")) {
+		pool->noh2    = true;
+		cp->keepalive = 1;
+		ssl_set_limit(cp, 0);
+		http_pool_put(pool, cp);
+		return (NULL);
+	}
+	if ((h2 = h2_new(cp)) == NULL)
+		ssl_disconnect(cp);
+	return (h2);
+}
+
+/*
+ * Drops the connection, and fails the streams that are still open with
+ * the failure class 'error'. If a new connection didn't answer anything,
+ * the jobs waiting for the next one fail, too.
+ */
+static void
+run_h2_drop(http_h2run_t *rp, http_job_t **jobs, int *next, int njobs,
+	    int error)
+{
+	int i;
+
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (rp->slots[i].job == NULL)
+			continue;
+		rp->slots[i].job->error = error;
+		slot_finish(&rp->slots[i], -1);
+	}
+	if (!rp->reused && rp->answered == 0) {
+		while (rp->nretry > 0)
+			job_fail(rp->retry[--rp->nretry], error);
+		for (; *next < njobs; (*next)++)
+			job_fail(jobs[*next], error);
+	}
+	h2_free(rp->h2);
+	rp->h2 = NULL;
+}
+
+/*
+ * Processes the jobs as concurrent streams of an HTTP/2 connection, or
+ * passes them to run_jobs() if the server doesn't speak HTTP/2.
+ */
+static int
+run_h2(http_pool_t *pool, http_job_t **jobs, int njobs, int maxconns,
+       int depth)
+{
+	int	      i, n, next, nactive, ret;
+	bool	      retried;
+	http_job_t    *job;
+	http_slot_t   *sp;
+	http_h2run_t  run;
+	struct pollfd pfd;
+
+	(void)memset(&run, 0, sizeof(run));
+	run.host    = pool->host;
+	run.retries = njobs;
+	run.slots = calloc(H2_MAX_STREAMS, sizeof(http_slot_t));
+	run.retry = calloc(njobs > 0 ? njobs : 1, sizeof(http_job_t *));
+	if (run.slots == NULL || run.retry == NULL) {
+		warn("calloc()"); free(run.slots); free(run.retry);
+		return (-1);
+	}
+	for (ret = next = 0;;) {
+		for (i = 0; i < H2_MAX_STREAMS; i++) {
+			sp = &run.slots[i];
+			while (sp->job == NULL && (next < njobs ||
+			    run.nretry > 0)) {
+				if (run.h2 != NULL && !h2_can_open(run.h2))
+					break;
+				if ((retried = run.nretry > 0))
+					job = run.retry[--run.nretry];
+				else
+					job = jobs[next++];
+				if (slot_prepare(sp, pool, job) != 0)
+					continue;
+				if (run.h2 == NULL) {
+					run.h2 = pool_h2(pool, &run.reused);
+					run.answered = 0;
+				}
+				if (run.h2 == NULL && pool->noh2) {
+					/* No HTTP/2. Go on with HTTP/1.1. */
+					slot_clear(sp);
+					sp->job = NULL;
+					if (retried)
+						run.retry[run.nretry++] = job;
+					else
+						next--;
+					if (run.nretry > 0) {
+						(void)run_jobs(pool, run.retry,
+						    run.nretry, 1, 1);
+						run.nretry = 0;
+					}
+					ret = run_jobs(pool, &jobs[next],
+					    njobs - next, maxconns, depth);
+					goto out;
+				} else if (run.h2 == NULL) {
+					sp->job->error = ssl_error;
+					slot_finish(sp, -1);
+					run.reused = false;
+					run_h2_drop(&run, jobs, &next, njobs,
+					    ssl_error);
+					continue;
+				}
+				run.h2->ops = &stream_ops;
+				run.h2->arg = &run;
+				sp->id = 0;
+				if (stream_start(&run, sp) == -1) {
+					run_h2_drop(&run, jobs, &next, njobs,
+					    SSL_ERR_IO);
+				}
+			}
+		}
+		if (run.h2 == NULL)
+			break;
+		for (i = nactive = 0; i < H2_MAX_STREAMS; i++) {
+			sp = &run.slots[i];
+			if (sp->job == NULL)
+				continue;
+			nactive++;
+			if (sp->id != 0 && stream_send(&run, sp) == -1)
+				break;
+		}
+		if (i < H2_MAX_STREAMS || h2_flush(run.h2) == -1) {
+			run_h2_drop(&run, jobs, &next, njobs, SSL_ERR_IO);
+			continue;
+		}
+		if (nactive == 0) {
+			if (next >= njobs && run.nretry == 0)
+				break;
+			/* GOAWAY. The rest needs a new connection. */
+			run_h2_drop(&run, jobs, &next, njobs, SSL_ERR_IO);
+			continue;
+		}
+		pfd.fd	    = run.h2->cp->sock;
+		pfd.events  = h2_events(run.h2);
+		pfd.revents = 0;
+		while ((n = poll(&pfd, 1,
+		    ssl_time_left(SSL_IO_TIMEOUT * 1000))) == -1) {
+			if (errno != EINTR) {
+				warn("poll()"); break;
+			}
+		}
+		if (n <= 0) {
+			if (n == 0 && !ssl_expired()) {
+				warnx("http_run(): Timeout");
+				ssl_error = SSL_ERR_TIMEOUT;
+			}
+			run.reused = false; run.answered = 0;
+			run_h2_drop(&run, jobs, &next, njobs,
+			    n == 0 ? ssl_error : SSL_ERR_NONE);
+			ret = n == 0 ? 0 : -1;
+			break;
+		}
+		if (h2_input(run.h2) == -1) {
+			if (run.h2->nstreams > 0 && !run.h2->goaway)
+				warnx("Connection closed by %s", pool->host);
+			run_h2_drop(&run, jobs, &next, njobs, SSL_ERR_IO);
+		}
+	}
+out:
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		free(run.slots[i].in);
+		free(run.slots[i].next);
+	}
+	if (run.h2 != NULL && !run.h2->goaway) {
+		run.h2->ops = NULL;
+		run.h2->arg = NULL;
+		pool->h2 = run.h2;
+	} else
+		h2_free(run.h2);
+	free(run.slots); free(run.retry);
+
+	return (ret);
+}
+
+/*
+ * Runs a batch over HTTP/2 if possible, and with run_jobs() otherwise.
+ * The jobs the retry policy sends again run as a new batch after the
+ * longest of their delays.
+ */
+static int
+run_batch(http_pool_t *pool, http_job_t *jobs, int njobs, int maxconns,
+	  int depth)
+{
+	int	   i, n, ret;
+	long	   wait;
+	http_job_t *job, **batch;
+
+	if ((batch = calloc(njobs > 0 ? njobs : 1, sizeof(*batch))) == NULL) {
+		warn("calloc()"); return (-1);
+	}
+	for (n = 0; n < njobs; n++) {
+		jobs[n].tries = 0;
+		jobs[n].retry = -1;
+		batch[n]      = &jobs[n];
+	}
+	for (;;) {
+		if (http_h2 && !http_offline && !pool->noh2)
+			ret = run_h2(pool, batch, n, maxconns, depth);
+		else
+			ret = run_jobs(pool, batch, n, maxconns, depth);
+		for (i = njobs = 0, wait = 0; i < n; i++) {
+			if ((job = batch[i])->retry < 0)
+				continue;
+			if (ret == -1) {
+				/* Give up. */
+				job->retry = -1;
+				if (job->done != NULL)
+					job->done(job);
+				continue;
+			}
+			if (job->retry > wait)
+				wait = job->retry;
+			free(job->body);
+			job->body = NULL;
+			job->len  = 0;
+			batch[njobs++] = job;
+		}
+		if (njobs == 0)
+			break;
+		warnx("%d of %d requests failed. Trying again in %.1f s",
+		    njobs, n, wait / 1000.0);
+		(void)poll(NULL, 0, (int)wait);
+		n = njobs;
+	}
+	free(batch);
+
+	return (ret);
+}
+
+/*
+ * Processes the 'njobs' requests in 'jobs' on up to 'maxconns' parallel
+ * connections from 'pool'. When a request is finished, its status code
+ * (or -1 on error), and the reply body are stored in the job, and the
+ * job's callback is called. The body must be freed by the caller.
+ * Connections that can be reused are returned to the pool.
+ *
+ * Returns 0 on success, and -1 if the engine itself failed.
+ */
+int
+http_run(http_pool_t *pool, http_job_t *jobs, int njobs, int maxconns)
+{
+	return (run_batch(pool, jobs, njobs, maxconns, 1));
+}
+
+/*
+ * Like http_run(), but writes up to HTTP_PIPELINE_DEPTH requests at once
+ * on a single connection, instead of waiting for each reply. This is for
+ * batches of small POST and DELETE requests. GET requests and uploads in
+ * the batch are sent one at a time.
+ */
+int
+http_pipeline(http_pool_t *pool, http_job_t *jobs, int njobs)
+{
+	return (run_batch(pool, jobs, njobs, 1, HTTP_PIPELINE_DEPTH));
+}
@@ -25,27 +25,162 @@
 #ifndef _HTTP_H_
 # define _HTTP_H_
 
+#define HTTP_CONTINUE		100
 #define HTTP_OK			200
 #define HTTP_CREATED		201
 #define HTTP_NO_CONTENT		204
 #define HTTP_FOUND		302
 #define HTTP_REDIRECT		302
+#define HTTP_NOT_MODIFIED	304
 #define HTTP_UNAUTHORIZED	401	
+#define HTTP_TOO_MANY_REQUESTS	429
+#define HTTP_SERVER_ERROR	500
+#define HTTP_BAD_GATEWAY	502
+#define HTTP_UNAVAILABLE	503
+#define HTTP_GATEWAY_TIMEOUT	504
+#define HTTP_RQ_TYPE_GET	1
+#define HTTP_RQ_TYPE_POST	2
+#define HTTP_RQ_TYPE_DELETE	3
 #define HTTP_POST_TYPE_JSON	1
 #define HTTP_POST_TYPE_OCTET	2
 #define HTTP_POST_TYPE_FORM	3
 #define HTTP_FILESZ_LIMIT	4194304	/* File size-limit in bytes. */
+#define HTTP_POOL_SIZE		4	/* Max. idle connections per pool. */
+#define HTTP_DRAIN_LIMIT	131072	/* Max. bytes to skip for reuse. */
+#define HTTP_INLINE_BODY	16384	/* Max. body to send with header. */
+#define HTTP_BODY_BUFSZ		65536	/* Initial body buffer w/o length. */
+#define HTTP_MAX_CONNS		4	/* Max. parallel connections. */
+#define HTTP_EXPECT_TIMEOUT	1000	/* ms to wait for 100 Continue. */
+#define HTTP_PIPELINE_DEPTH	16	/* Max. pipelined requests. */
+#define HTTP_RETRIES		3	/* Max. retries of idempotent requests. */
+#define HTTP_RETRIES_POST	2	/* Max. retries of POST requests. */
+#define HTTP_BACKOFF_BASE	500	/* ms to wait before the first retry. */
+#define HTTP_BACKOFF_MAX	16000	/* Max. ms to wait between retries. */
+#define HTTP_RETRY_AFTER_MAX	120	/* Max. Retry-After in seconds. */
+#define HTTP_ENC_IDENTITY	0
+#define HTTP_ENC_GZIP		1
+#define HTTP_ENC_DEFLATE	2
 
+/*
+ * Indices of the header fields kept in http_resp_t.
+ */
+#define HTTP_F_CONTENT_TYPE	0
+#define HTTP_F_LOCATION		1
+#define HTTP_F_ETAG		2
+#define HTTP_F_LAST_MODIFIED	3
+#define HTTP_F_CACHE_CONTROL	4
+#define HTTP_F_RETRY_AFTER	5
+#define HTTP_F_DATE		6
+#define HTTP_NFIELDS		7
+
+typedef struct http_pool_s {
+	int	   nidle;
+	bool	   noh2;	/* Server doesn't speak HTTP/2. */
+	u_short	   port;
+	char	   *host;
+	ssl_conn_t *idle[HTTP_POOL_SIZE];
+	struct h2_conn_s *h2;	/* Idle HTTP/2 connection, or NULL */
+} http_pool_t;
+
+/*
+ * Max. age in seconds of cached documents whose URL starts with 'prefix'.
+ */
+typedef struct http_ttl_s {
+	const char *prefix;
+	int	   secs;
+} http_ttl_t;
+
+/*
+ * A field of a form for http_post_form(). Name and value are URL encoded
+ * when the form is sent.
+ */
+typedef struct http_field_s {
+	const char *name;
+	const char *value;
+} http_field_t;
+
+/*
+ * The status line and header of a server reply, parsed in one pass.
+ */
+typedef struct http_resp_s {
+	int    status;
+	int    encoding;	/* Content-Encoding (HTTP_ENC_*) */
+	long   clen;		/* Content-Length, or -1 */
+	bool   chunked;		/* Transfer-Encoding: chunked */
+	bool   keepalive;	/* Connection can be reused. */
+	int    ncookies;
+	char   **cookies;	/* "name=value" of each Set-Cookie field */
+	char   *field[HTTP_NFIELDS]; /* Field values (HTTP_F_*), or NULL */
+} http_resp_t;
+
+typedef struct http_chunked_s {
+	int	state;
+#define HTTP_CHUNK_SIZE		0	/* Chunk size and extensions */
+#define HTTP_CHUNK_DATA		1
+#define HTTP_CHUNK_DATA_END	2	/* CRLF after the chunk data */
+#define HTTP_CHUNK_TRAILER	3
+#define HTTP_CHUNK_DONE		4
+	int	ndigits;	/* Hex digits of the chunk size read */
+	int	ext;		/* Skipping a chunk extension */
+	long	left;		/* Bytes left in the current chunk */
+	size_t	lnlen;
+	char	ln[256];	/* Current trailer line */
+	void	*arg;		/* Argument for the callbacks */
+	int	(*data)(void *, const char *, size_t);
+	int	(*trailer)(void *, char *);
+} http_chunked_t;
+
+/*
+ * A request for http_run(). The fields below 'done' are set by the engine.
+ */
+typedef struct http_job_s {
+	int	   type;	/* HTTP_RQ_TYPE_* */
+	int	   ctype;	/* HTTP_POST_TYPE_* of POST requests */
+	const char *url;
+	const char *cookie;
+	const char *accept;
+	const char *agent;
+	const char *content;	/* Body of POST requests, or NULL */
+	const char *file;	/* File to send as body instead of content */
+	void	   *arg;	/* For use by the callback */
+	void	   (*done)(struct http_job_s *);
+	int	   status;	/* Status code of the reply, or -1 */
+	char	   *body;	/* Reply body, or NULL */
+	size_t	   len;		/* Length of body */
+	int	   error;	/* SSL_ERR_* class of a failure */
+	int	   tries;	/* Attempts so far */
+	long	   retry;	/* ms to wait before sending it again, or -1 */
+} http_job_t;
+
+extern int  http_max_age;
+extern bool http_cache;
+extern bool http_offline;
+extern bool http_h2;
+extern const http_ttl_t *http_ttls;
 extern int  http_get(ssl_conn_t *, const char *, const char *, const char *,
 		     const char *);
 extern int  http_post(ssl_conn_t *, const char *, const char *, const char *,
 		      const char *, int, const char *);
-extern int  http_delete(ssl_conn_t *, const char *, const char *,
-		        const char *);
-extern int  http_upload(ssl_conn_t *, const char *, const char *, const char *,
-			const char *, const char *);
+extern int  http_post_form(ssl_conn_t *, const char *, const char *,
+			   const char *, const char *, const http_field_t *,
+			   int);
 extern int  get_http_status(ssl_conn_t *);
+extern const http_resp_t *http_reply(ssl_conn_t *);
+extern const char *http_cookie(const http_resp_t *, const char *);
+extern char *http_read_body(ssl_conn_t *, size_t *);
+extern long http_chunked(http_chunked_t *, const char *, size_t);
+extern void http_chunked_init(http_chunked_t *, int (*)(void *, const char *,
+			      size_t), int (*)(void *, char *), void *);
+extern int  http_run(http_pool_t *, http_job_t *, int, int);
+extern int  http_backoff(int, int);
+extern int  http_pipeline(http_pool_t *, http_job_t *, int);
 extern char *urlencode(const char *);
+extern char *urlencode_to(char *, const char *, size_t);
+extern size_t urlencode_len(const char *, size_t);
+extern void http_pool_put(http_pool_t *, ssl_conn_t *);
+extern void http_pool_free(http_pool_t *);
+extern ssl_conn_t  *http_pool_get(http_pool_t *);
+extern http_pool_t *http_pool_new(const char *, u_short);
 
 #endif /* !_HTTP_H_ */
 
@@ -29,8 +29,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -38,80 +41,786 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 
 #include "types.h"
 #include "ssl.h"
+#include "cache.h"
+#include "dns.h"
 
-ssl_conn_t *
-ssl_connect(const char *host, u_short port)
+/*
+ * SSL contexts are shared by all connections to the same host with the
+ * same options. They are created on first use, and freed at exit.
+ */
+typedef struct ssl_ctx_cache_s {
+	int	refcnt;
+	int	opts;
+	char	*host;
+	SSL_CTX	*ctx;
+	struct ssl_ctx_cache_s *next;
+} ssl_ctx_cache_t;
+
+static ssl_ctx_cache_t *ctx_cache = NULL;
+
+int  ssl_connect_timeout = SSL_CONNECT_TIMEOUT;
+int  ssl_error = SSL_ERR_NONE;	/* Class of the last failure. */
+bool ssl_ktls = false;		/* Request kernel TLS for new connections. */
+
+static long deadline = 0;	/* End of the command in ms, or 0 */
+
+static void
+ssl_cleanup(void)
 {
-	int	s;
-	SSL	*handle;
-	SSL_CTX *ctx;
-	ssl_conn_t	   *cp;
-	static int	   init = 1;
-	struct sockaddr_in target;
+	ssl_ctx_cache_t *cc, *next;
 
-	errno = 0;
-	if (init == 1) {
+	for (cc = ctx_cache; cc != NULL; cc = next) {
+		next = cc->next;
+		SSL_CTX_free(cc->ctx);
+		free(cc->host);
+		free(cc);
+	}
+	ctx_cache = NULL;
+}
+
+/*
+ * TLS sessions are saved to PATH_SESSIONS, so the next invocation can
+ * resume the session with an abbreviated handshake. The cache key is
+ * "host:port".
+ */
+static SSL_SESSION *
+sess_load(const char *key)
+{
+	int	      len;
+	char	      *b64;
+	u_char	      *der;
+	const u_char  *p;
+	SSL_SESSION   *sess;
+
+	if ((b64 = cache_get(PATH_SESSIONS, key)) == NULL)
+		return (NULL);
+	len = strlen(b64);
+	if ((der = malloc(len)) == NULL) {
+		free(b64); return (NULL);
+	}
+	len  = EVP_DecodeBlock(der, (u_char *)b64, len);
+	p    = der;
+	sess = len > 0 ? d2i_SSL_SESSION(NULL, &p, len) : NULL;
+	free(b64); free(der);
+	if (sess == NULL)
+		return (NULL);
+	if (SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) <
+	    time(NULL)) {
+		SSL_SESSION_free(sess);
+		(void)cache_put(PATH_SESSIONS, key, NULL);
+		return (NULL);
+	}
+	return (sess);
+}
+
+static void
+sess_save(const char *key, SSL_SESSION *sess)
+{
+	int    len;
+	char   *b64;
+	u_char *der, *p;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (!SSL_SESSION_is_resumable(sess))
+		return;
+#endif
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0)
+		return;
+	if ((der = malloc(len)) == NULL)
+		return;
+	if ((b64 = malloc(4 * ((len + 2) / 3) + 1)) == NULL) {
+		free(der); return;
+	}
+	p = der;
+	(void)i2d_SSL_SESSION(sess, &p);
+	(void)EVP_EncodeBlock((u_char *)b64, der, len);
+	(void)cache_put(PATH_SESSIONS, key, b64);
+	free(der); free(b64);
+}
+
+static void
+sess_key(char *key, size_t size, const char *host, u_short port)
+{
+	(void)snprintf(key, size, "%s:%u", host, port);
+}
+
+/*
+ * Called by OpenSSL whenever the server hands out a new session or
+ * session ticket.
+ */
+static int
+sess_new_cb(SSL *handle, SSL_SESSION *sess)
+{
+	char			key[NI_MAXHOST + 8];
+	u_short			port;
+	socklen_t		len;
+	const char		*host;
+	struct sockaddr_storage sa;
+
+	len = sizeof(sa);
+	host = SSL_get_servername(handle, TLSEXT_NAMETYPE_host_name);
+	if (host == NULL || getpeername(SSL_get_fd(handle),
+	    (struct sockaddr *)&sa, &len) == -1)
+		return (0);
+	if (sa.ss_family == AF_INET6)
+		port = ntohs(((struct sockaddr_in6 *)&sa)->sin6_port);
+	else
+		port = ntohs(((struct sockaddr_in *)&sa)->sin_port);
+	sess_key(key, sizeof(key), host, port);
+	sess_save(key, sess);
+
+	return (0);
+}
+
+static SSL_CTX *
+ssl_ctx_get(const char *host, int opts)
+{
+	static bool	init = true;
+	ssl_ctx_cache_t *cc;
+
+	if (init) {
 		SSL_load_error_strings();
 		(void)SSL_library_init();
-		init = 0;
+		(void)atexit(ssl_cleanup);
+		init = false;
 	}
-        if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-		return (NULL);
-	(void)memset(&target, 0, sizeof(target));
-	target.sin_family = AF_INET;
-	target.sin_port = htons(port);
-	if ((target.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) {
-		struct hostent *t_info;
-
-		if ((t_info = gethostbyname(host)) == NULL) {
-			herror("gethostbyname()");
-			return (NULL);
+	for (cc = ctx_cache; cc != NULL; cc = cc->next) {
+		if (cc->opts == opts && strcmp(cc->host, host) == 0) {
+			cc->refcnt++;
+			return (cc->ctx);
 		}
-		(void)memcpy((char *)&target.sin_addr.s_addr, t_info->h_addr,
-		    t_info->h_length);
 	}
-	if (connect(s, (struct sockaddr *)&target,
-	    sizeof(struct sockaddr)) == -1)
-		return (NULL);
-	if ((ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+	if ((cc = malloc(sizeof(ssl_ctx_cache_t))) == NULL) {
+		warn("malloc()"); return (NULL);
+	}
+	if ((cc->host = strdup(host)) == NULL) {
+		warn("strdup()"); free(cc); return (NULL);
+	}
+	if ((cc->ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
 		ERR_print_errors_fp(stderr);
+		free(cc->host); free(cc);
 		return (NULL);
 	}
+	SSL_CTX_set_session_cache_mode(cc->ctx, SSL_SESS_CACHE_CLIENT |
+	    SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(cc->ctx, sess_new_cb);
+#ifdef SSL_OP_ENABLE_KTLS
+	/*
+	 * OpenSSL hands the keys to the kernel after the handshake if the
+	 * kernel and the negotiated cipher support it. Otherwise the
+	 * connection silently stays in user space.
+	 */
+	if (opts & SSL_OPT_KTLS)
+		(void)SSL_CTX_set_options(cc->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	/* Offer HTTP/2, but let the server fall back to HTTP/1.1. */
+	if ((opts & SSL_OPT_H2) && SSL_CTX_set_alpn_protos(cc->ctx,
+	    (const u_char *)SSL_ALPN_H2, sizeof(SSL_ALPN_H2) - 1) != 0)
+		ERR_print_errors_fp(stderr);
+	cc->opts   = opts;
+	cc->refcnt = 1;
+	cc->next   = ctx_cache;
+	ctx_cache  = cc;
+
+	return (cc->ctx);
+}
+
+static void
+ssl_ctx_release(SSL_CTX *ctx)
+{
+	ssl_ctx_cache_t *cc;
+
+	for (cc = ctx_cache; cc != NULL; cc = cc->next) {
+		if (cc->ctx == ctx) {
+			cc->refcnt--;
+			return;
+		}
+	}
+}
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Sets the deadline of the command to 'secs' seconds from now, or removes
+ * it if 'secs' is 0. Once it has passed, connects, reads and writes fail
+ * right away.
+ */
+void
+ssl_set_deadline(int secs)
+{
+	deadline = secs > 0 ? now_ms() + secs * 1000L : 0;
+}
+
+/*
+ * Returns 'ms', or the number of ms left until the deadline if that is
+ * less. A negative 'ms' means no limit.
+ */
+int
+ssl_time_left(int ms)
+{
+	long left;
+
+	if (deadline == 0)
+		return (ms);
+	if ((left = deadline - now_ms()) < 0)
+		left = 0;
+	return (ms < 0 || left < ms ? (int)left : ms);
+}
+
+/*
+ * Returns true, and sets ssl_error, if the deadline has passed.
+ */
+bool
+ssl_expired(void)
+{
+	static bool told = false;
+
+	if (deadline == 0 || now_ms() < deadline)
+		return (false);
+	if (!told) {
+		warnx("Deadline exceeded");
+		told = true;
+	}
+	ssl_error = SSL_ERR_DEADLINE;
+
+	return (true);
+}
+
+/*
+ * Orders the addresses as described in RFC 8305, section 4: Alternate
+ * between address families, starting with the family of the first
+ * address.
+ */
+static void
+sort_addrs(dns_addr_t *addrs, int n)
+{
+	int	   i, j;
+	dns_addr_t tmp;
+
+	for (i = 1; i < n; i++) {
+		if (addrs[i].sa.ss_family != addrs[i - 1].sa.ss_family)
+			continue;
+		/* Find the next address of the other family. */
+		for (j = i + 1; j < n &&
+		    addrs[j].sa.ss_family == addrs[i - 1].sa.ss_family; j++)
+			;
+		if (j == n)
+			break;
+		tmp = addrs[j];
+		(void)memmove(&addrs[i + 1], &addrs[i],
+		    (j - i) * sizeof(dns_addr_t));
+		addrs[i] = tmp;
+	}
+}
+
+/*
+ * State of the connection attempts to a host by the "Happy Eyeballs"
+ * algorithm (RFC 8305). A new connection attempt is started every
+ * SSL_ATTEMPT_DELAY ms, or as soon as the previous attempt failed. The
+ * first attempt that succeeds wins. All attempts are aborted after the
+ * connect timeout, or when the deadline has passed.
+ */
+typedef struct tcp_attempts_s {
+	int	      opts;	/* SSL_OPT_* of the TLS connection */
+	int	      error;	/* errno of the last failed attempt */
+	int	      naddrs;
+	int	      next;	/* Index of the next address to try */
+	int	      npending;
+	long	      start;	/* Time to start the next attempt in ms */
+	long	      end;	/* Time to give up in ms */
+	dns_addr_t    addrs[DNS_MAX_ADDRS];
+	struct pollfd pfd[DNS_MAX_ADDRS]; /* Pending attempts */
+} tcp_attempts_t;
+
+#define TCP_PENDING (-2)	/* No attempt has succeeded yet. */
+
+/*
+ * Resolves 'host', and prepares the attempts to connect to it within
+ * 'timeout' seconds.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+static int
+tcp_start(tcp_attempts_t *ta, const char *host, u_short port, int timeout)
+{
+	ta->next = ta->npending = ta->error = 0;
+	if (ssl_expired())
+		return (-1);
+	ta->naddrs = dns_resolve(host, port, ta->addrs, DNS_MAX_ADDRS);
+	if (ta->naddrs == -1) {
+		ssl_error = SSL_ERR_CONNECT; return (-1);
+	}
+	sort_addrs(ta->addrs, ta->naddrs);
+	ta->start = now_ms();
+	ta->end	  = ta->start + ssl_time_left(timeout * 1000);
+
+	return (0);
+}
+
+/*
+ * Closes the sockets of the pending attempts except 's'.
+ */
+static void
+tcp_abort(tcp_attempts_t *ta, int s)
+{
+	int n;
+
+	for (n = 0; n < ta->npending; n++) {
+		if (ta->pfd[n].fd != s)
+			(void)close(ta->pfd[n].fd);
+	}
+	ta->npending = 0;
+}
+
+/*
+ * Starts the attempts that are due, and checks whether one of the pending
+ * attempts succeeded, without waiting.
+ *
+ * Returns a connected, blocking socket, TCP_PENDING if the attempts are
+ * still in progress, or -1 on error.
+ */
+static int
+tcp_step(tcp_attempts_t *ta, const char *host)
+{
+	int	  n, s, error;
+	long	  now;
+	socklen_t len;
+	struct pollfd *pfd;
+
+	for (s = -1, now = now_ms(); s == -1; now = now_ms()) {
+		if (ta->next < ta->naddrs && now >= ta->start) {
+			pfd = &ta->pfd[ta->npending];
+			pfd->fd = socket(ta->addrs[ta->next].sa.ss_family,
+			    SOCK_STREAM, 0);
+			if (pfd->fd != -1) {
+				(void)fcntl(pfd->fd, F_SETFL, O_NONBLOCK);
+				pfd->events = POLLOUT;
+				if (connect(pfd->fd,
+				    (struct sockaddr *)&ta->addrs[ta->next].sa,
+				    ta->addrs[ta->next].len) == 0)
+					s = ta->pfd[ta->npending++].fd;
+				else if (errno == EINPROGRESS)
+					ta->npending++;
+				else {
+					ta->error = errno;
+					(void)close(pfd->fd);
+				}
+			} else
+				ta->error = errno;
+			if (++ta->next == ta->naddrs || ta->npending == 0)
+				ta->start = now;
+			else
+				ta->start = now + SSL_ATTEMPT_DELAY;
+			continue;
+		}
+		if (ta->npending == 0 && ta->next == ta->naddrs)
+			break;
+		if (now >= ta->end) {
+			if (!ssl_expired())
+				warnx("Timeout while connecting to %s", host);
+			ta->error = ETIMEDOUT;
+			break;
+		}
+		if ((n = poll(ta->pfd, ta->npending, 0)) == -1 &&
+		    errno != EINTR) {
+			warn("poll()");
+			ta->error = errno;
+			break;
+		} else if (n <= 0)
+			return (TCP_PENDING);
+		for (n = 0; n < ta->npending && s == -1; n++) {
+			if (ta->pfd[n].revents == 0)
+				continue;
+			len = sizeof(error);
+			if (getsockopt(ta->pfd[n].fd, SOL_SOCKET, SO_ERROR,
+			    &error, &len) == 0 && error == 0) {
+				s = ta->pfd[n].fd;
+				break;
+			}
+			/* Attempt failed. Start the next one right away. */
+			(void)close(ta->pfd[n].fd);
+			ta->pfd[n--] = ta->pfd[--ta->npending];
+			ta->start = now;
+			ta->error = error;
+		}
+	}
+	tcp_abort(ta, s);
+	if (s != -1) {
+		(void)fcntl(s, F_SETFL, 0);
+		/*
+		 * Requests are written in as few records as possible, so
+		 * there is nothing for Nagle's algorithm to coalesce.
+		 * Waiting for the ACK of the previous segment would just
+		 * delay the last segment of a request.
+		 */
+		n = 1;
+		(void)setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n));
+	} else {
+		errno = ta->error;
+		if (!ssl_expired()) {
+			ssl_error = ta->error == ETIMEDOUT ? SSL_ERR_TIMEOUT :
+			    SSL_ERR_CONNECT;
+		}
+	}
+	return (s);
+}
+
+/*
+ * Returns the number of ms until the next attempt is due, or the attempts
+ * time out.
+ */
+static int
+tcp_wait(const tcp_attempts_t *ta)
+{
+	long wait;
+
+	wait = (ta->next < ta->naddrs && ta->start < ta->end ? ta->start :
+	    ta->end) - now_ms();
+	return (wait > 0 ? (int)wait : 0);
+}
+
+/*
+ * Connects to the given host within 'timeout' seconds.
+ *
+ * Returns a connected, blocking socket, or -1 on error.
+ */
+static int
+tcp_connect(const char *host, u_short port, int timeout)
+{
+	int	       s;
+	tcp_attempts_t ta;
+
+	if (tcp_start(&ta, host, port, timeout) == -1)
+		return (-1);
+	while ((s = tcp_step(&ta, host)) == TCP_PENDING) {
+		if (poll(ta.pfd, ta.npending, tcp_wait(&ta)) == -1 &&
+		    errno != EINTR) {
+			warn("poll()");
+			tcp_abort(&ta, -1);
+			ssl_error = SSL_ERR_CONNECT;
+			return (-1);
+		}
+	}
+	return (s);
+}
+
+/*
+ * Prepares the TLS handle of the connection 'cp' on the connected socket
+ * 's', and sets the connection up for the handshake.
+ *
+ * Returns 0 on success, and -1 on error. The socket is closed on error.
+ */
+static int
+tls_open(ssl_conn_t *cp, int s, int opts)
+{
+	SSL	*handle;
+	char	key[NI_MAXHOST + 8];
+	SSL_CTX *ctx;
+	SSL_SESSION *sess;
+
+	if (ssl_ktls)
+		opts |= SSL_OPT_KTLS;
+	if ((ctx = ssl_ctx_get(cp->host, opts)) == NULL) {
+		(void)close(s); return (-1);
+	}
 	if ((handle = SSL_new(ctx)) == NULL) {
 		ERR_print_errors_fp(stderr);
-		return (NULL);
+		(void)close(s); ssl_ctx_release(ctx);
+		return (-1);
 	}
 	if (SSL_set_fd(handle, s) == 0) {
 		ERR_print_errors_fp(stderr);
-		(void)close(s); SSL_free(handle);
-		return (NULL);
+		(void)close(s); SSL_free(handle); ssl_ctx_release(ctx);
+		return (-1);
 	}
 
-	if (!SSL_set_tlsext_host_name(handle, host))
+	if (!SSL_set_tlsext_host_name(handle, cp->host))
 		ERR_print_errors_fp(stderr);
+	sess_key(key, sizeof(key), cp->host, cp->port);
+	if ((sess = sess_load(key)) != NULL) {
+		(void)SSL_set_session(handle, sess);
+		SSL_SESSION_free(sess);
+	}
+	cp->ctx	   = ctx;
+	cp->sock   = s;
+	cp->handle = handle;
+	cp->state  = SSL_STATE_HANDSHAKE;
 
-	if (SSL_connect(handle) != 1) {
-		ERR_print_errors_fp(stderr);
-		(void)close(s); SSL_free(handle);
+	return (0);
+}
+
+/*
+ * Starts to connect to the given host, but leaves the rest of the TCP
+ * connect to ssl_connecting(), and the TLS handshake to ssl_handshake().
+ * This allows the caller to drive the connects and handshakes of several
+ * connections on non-blocking sockets at once. Only resolving the host
+ * name blocks.
+ */
+ssl_conn_t *
+ssl_open(const char *host, u_short port)
+{
+	ssl_conn_t *cp;
+
+	errno = 0;
+	ssl_error = SSL_ERR_NONE;
+	if ((cp = ssl_new(host, port)) == NULL)
 		return (NULL);
+	if ((cp->attempts = malloc(sizeof(tcp_attempts_t))) == NULL) {
+		warn("malloc()"); ssl_disconnect(cp); return (NULL);
 	}
-	if ((cp = malloc(sizeof(ssl_conn_t))) == NULL) {
-		warn("malloc()"); (void)close(s); SSL_free(handle);
+	cp->attempts->opts = SSL_OPT_DEFAULT;
+	if (tcp_start(cp->attempts, host, port, ssl_connect_timeout) == -1) {
+		ssl_disconnect(cp); return (NULL);
+	}
+	cp->state = SSL_STATE_CONNECTING;
+	if (ssl_connecting(cp) == -1) {
+		ssl_disconnect(cp); return (NULL);
+	}
+	return (cp);
+}
+
+/*
+ * Advances the connection attempts of a connection from ssl_open().
+ *
+ * Returns 1 if the connection is ready for the TLS handshake, 0 if the
+ * attempts are still in progress, and -1 on error. In the second case,
+ * ssl_connect_fds() and ssl_connect_wait() tell what to wait for.
+ */
+int
+ssl_connecting(ssl_conn_t *cp)
+{
+	int	       s;
+	tcp_attempts_t *ta;
+
+	if ((ta = cp->attempts) == NULL)
+		return (cp->state == SSL_STATE_CONNECTING ? -1 : 1);
+	if ((s = tcp_step(ta, cp->host)) == TCP_PENDING)
+		return (0);
+	cp->attempts = NULL;
+	if (s == -1 || tls_open(cp, s, ta->opts) == -1) {
+		free(ta); return (-1);
+	}
+	free(ta);
+
+	return (1);
+}
+
+/*
+ * Stores the sockets of the pending connection attempts in 'pfd', which
+ * must have room for DNS_MAX_ADDRS entries.
+ *
+ * Returns the number of sockets.
+ */
+int
+ssl_connect_fds(const ssl_conn_t *cp, struct pollfd *pfd)
+{
+	int n;
+
+	if (cp->attempts == NULL)
+		return (0);
+	for (n = 0; n < cp->attempts->npending; n++) {
+		pfd[n].fd      = cp->attempts->pfd[n].fd;
+		pfd[n].events  = POLLOUT;
+		pfd[n].revents = 0;
+	}
+	return (n);
+}
+
+/*
+ * Returns the number of ms ssl_connecting() may be called later at the
+ * latest.
+ */
+int
+ssl_connect_wait(const ssl_conn_t *cp)
+{
+	return (cp->attempts != NULL ? tcp_wait(cp->attempts) : 0);
+}
+
+/*
+ * Like ssl_open(), but connects the socket before it returns, and uses
+ * the given SSL_OPT_* options. SSL_OPT_KTLS is added if kernel TLS is
+ * enabled.
+ */
+ssl_conn_t *
+ssl_open_opts(const char *host, u_short port, int opts)
+{
+	int	   s;
+	ssl_conn_t *cp;
+
+	errno = 0;
+	ssl_error = SSL_ERR_NONE;
+	if ((s = tcp_connect(host, port, ssl_connect_timeout)) == -1)
 		return (NULL);
+	if ((cp = ssl_new(host, port)) == NULL) {
+		(void)close(s); return (NULL);
 	}
-	cp->ctx	   = ctx;
-	cp->sock   = s;
-	cp->handle = handle;
+	if (tls_open(cp, s, opts) == -1) {
+		ssl_disconnect(cp); return (NULL);
+	}
+	return (cp);
+}
+
+/*
+ * Creates a connection object for the given host without connecting.
+ * ssl_reconnect() establishes the connection when it's needed.
+ */
+ssl_conn_t *
+ssl_new(const char *host, u_short port)
+{
+	ssl_conn_t *cp;
+
+	if ((cp = malloc(sizeof(ssl_conn_t))) == NULL) {
+		warn("malloc()"); return (NULL);
+	}
+	cp->ctx	   = NULL;
+	cp->sock   = -1;
+	cp->port   = port;
+	cp->limit  = -1;
+	cp->handle = NULL;
 	cp->lnbuf  = NULL;
-	cp->state  = SSL_STATE_CONNECTED;
+	cp->fdata  = cp->reply = NULL;
+	cp->ffree  = cp->rfree = NULL;
+	cp->filter = NULL;
+	cp->attempts = NULL;
+	cp->state  = SSL_STATE_DISCONNECTED;
 	cp->slen   = cp->bufsz = cp->rd = 0;
-	cp->host   = strdup(host);
-	if (cp->host == NULL) {
-		warn("strdup()"); ssl_disconnect(cp);
+	cp->nreq   = cp->keepalive = 0;
+	if ((cp->host = strdup(host)) == NULL) {
+		warn("strdup()"); free(cp); return (NULL);
+	}
+	return (cp);
+}
+
+/*
+ * Performs (the next step of) the TLS handshake.
+ *
+ * Returns 1 if the handshake is complete, and -1 on error. On a
+ * non-blocking socket, 0 is returned if the handshake can't proceed yet.
+ * ssl_events() tells what to wait for in that case.
+ */
+int
+ssl_handshake(ssl_conn_t *cp)
+{
+	int n;
+
+	if ((n = SSL_connect(cp->handle)) == 1) {
+		cp->state = SSL_STATE_CONNECTED;
+		return (1);
+	}
+	if (ssl_events(cp, n) > 0)
+		return (0);
+	ERR_print_errors_fp(stderr);
+	ssl_error = SSL_ERR_TLS;
+
+	return (-1);
+}
+
+/*
+ * Translates the return value 'ret' of a failed SSL_connect(), SSL_read()
+ * or SSL_write() on a non-blocking socket into the poll(2) events the call
+ * is waiting for.
+ *
+ * Returns POLLIN or POLLOUT, and -1 if the call failed for good.
+ */
+int
+ssl_events(ssl_conn_t *cp, int ret)
+{
+	switch (SSL_get_error(cp->handle, ret)) {
+	case SSL_ERROR_WANT_READ:
+		return (POLLIN);
+	case SSL_ERROR_WANT_WRITE:
+		return (POLLOUT);
+	}
+	return (-1);
+}
+
+/*
+ * Switches the connection's socket to non-blocking mode and back.
+ */
+int
+ssl_set_nonblock(ssl_conn_t *cp, bool on)
+{
+	int flags;
+
+	if ((flags = fcntl(cp->sock, F_GETFL)) == -1) {
+		warn("fcntl()"); return (-1);
+	}
+	flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	if (fcntl(cp->sock, F_SETFL, flags) == -1) {
+		warn("fcntl()"); return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Waits up to 'ms' milliseconds, but not beyond the deadline, for the
+ * given poll(2) events on the connection's socket. Unlike select(2),
+ * poll(2) is not limited to descriptors below FD_SETSIZE.
+ *
+ * Returns 1 if the socket is ready, 0 on timeout, and -1 on error. On
+ * timeout, ssl_error tells whether the deadline has passed.
+ */
+static int
+ssl_wait(ssl_conn_t *cp, int events, long ms)
+{
+	int	      n;
+	struct pollfd pfd;
+
+	pfd.fd = cp->sock; pfd.events = events; pfd.revents = 0;
+	if (ms < 0)
+		ms = 0;
+	while ((n = poll(&pfd, 1, ssl_time_left((int)ms))) == -1) {
+		if (errno != EINTR) {
+			warn("poll()"); return (-1);
+		}
+	}
+	if (n == 0 && !ssl_expired())
+		ssl_error = SSL_ERR_TIMEOUT;
+	return (n > 0 ? 1 : 0);
+}
+
+ssl_conn_t *
+ssl_connect(const char *host, u_short port)
+{
+	return (ssl_connect_opts(host, port, SSL_OPT_DEFAULT));
+}
+
+/*
+ * Like ssl_open_opts(), but also performs the TLS handshake. The
+ * handshake must be complete within the connect timeout.
+ */
+ssl_conn_t *
+ssl_connect_opts(const char *host, u_short port, int opts)
+{
+	int	   n;
+	long	   end;
+	ssl_conn_t *cp;
+
+	if ((cp = ssl_open_opts(host, port, opts)) == NULL)
 		return (NULL);
+	if (ssl_set_nonblock(cp, true) == -1) {
+		ssl_disconnect(cp); return (NULL);
+	}
+	end = now_ms() + ssl_connect_timeout * 1000L;
+	while ((n = ssl_handshake(cp)) == 0) {
+		if (ssl_wait(cp, ssl_events(cp, -1), end - now_ms()) <= 0)
+			break;
+	}
+	if (n != 1 || ssl_set_nonblock(cp, false) == -1) {
+		if (n == 0 && ssl_error == SSL_ERR_TIMEOUT)
+			warnx("Timeout during TLS handshake with %s", host);
+		ssl_disconnect(cp); return (NULL);
 	}
 	return (cp);
 }
@@ -122,45 +831,207 @@ ssl_disconnect(ssl_conn_t *cp)
 	int saved_errno;
 
 	saved_errno = errno;
-	(void)close(cp->sock);
-	SSL_shutdown(cp->handle);
-	SSL_free(cp->handle);
-	SSL_CTX_free(cp->ctx);
+	if (cp->attempts != NULL) {
+		tcp_abort(cp->attempts, -1);
+		free(cp->attempts);
+	}
+	if (cp->handle != NULL) {
+		(void)close(cp->sock);
+		SSL_shutdown(cp->handle);
+		SSL_free(cp->handle);
+		ssl_ctx_release(cp->ctx);
+	}
 	free(cp->host);
+	ssl_set_filter(cp, NULL, NULL, NULL);
 	free(cp->lnbuf);
+	if (cp->reply != NULL && cp->rfree != NULL)
+		cp->rfree(cp->reply);
 	free(cp);
 	errno = saved_errno;
 }
 
+/*
+ * Replaces the connection's socket and TLS handle by a new connection to
+ * the same host, and discards all buffered input. A connection created
+ * by ssl_new() is connected for the first time.
+ */
 int
-ssl_read(ssl_conn_t *cp, int waitsecs, void *buf, int size)
+ssl_reconnect(ssl_conn_t *cp)
+{
+	ssl_conn_t *np;
+
+	if ((np = ssl_connect(cp->host, cp->port)) == NULL)
+		return (-1);
+	if (cp->handle != NULL) {
+		(void)close(cp->sock);
+		SSL_shutdown(cp->handle);
+		SSL_free(cp->handle);
+		ssl_ctx_release(cp->ctx);
+	}
+
+	cp->ctx	      = np->ctx;
+	cp->sock      = np->sock;
+	cp->state     = SSL_STATE_CONNECTED;
+	cp->handle    = np->handle;
+	cp->limit     = -1;
+	cp->slen      = cp->rd = 0;
+	cp->nreq      = cp->keepalive = 0;
+	ssl_set_filter(cp, NULL, NULL, NULL);
+	free(np->host);
+	free(np);
+
+	return (0);
+}
+
+/*
+ * Checks whether an idle connection can still be used. A readable socket
+ * means the peer either closed the connection or sent unsolicited data,
+ * unless it only sent TLS records without data, like session tickets.
+ */
+bool
+ssl_alive(ssl_conn_t *cp)
+{
+	int	      n;
+	char	      c;
+	bool	      alive;
+	struct pollfd pfd;
+
+	if (cp->state != SSL_STATE_CONNECTED || SSL_pending(cp->handle) > 0)
+		return (false);
+	pfd.fd = cp->sock; pfd.events = POLLIN; pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == 0)
+		return (true);
+	if (ssl_set_nonblock(cp, true) == -1)
+		return (false);
+	n = SSL_peek(cp->handle, &c, 1);
+	alive = n <= 0 && ssl_events(cp, n) == POLLIN ? true : false;
+	if (ssl_set_nonblock(cp, false) == -1)
+		return (false);
+	return (alive);
+}
+
+/*
+ * Returns true if the kernel encrypts the data sent over the connection.
+ */
+bool
+ssl_ktls_send(ssl_conn_t *cp)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	if (cp->handle != NULL && BIO_get_ktls_send(SSL_get_wbio(cp->handle)))
+		return (true);
+#endif
+	return (false);
+}
+
+/*
+ * Returns true if the server selected the given protocol by ALPN.
+ */
+bool
+ssl_alpn_is(ssl_conn_t *cp, const char *proto)
+{
+	u_int	     len;
+	const u_char *p;
+
+	if (cp->handle == NULL)
+		return (false);
+	SSL_get0_alpn_selected(cp->handle, &p, &len);
+	if (p == NULL || len != strlen(proto))
+		return (false);
+	return (memcmp(p, proto, len) == 0);
+}
+
+/*
+ * Sends up to 'len' bytes of the file 'fd', starting at 'off', without
+ * copying them to user space. Only works if ssl_ktls_send() is true.
+ *
+ * Returns the number of bytes sent like SSL_write(). On a non-blocking
+ * socket, ssl_events() tells what to wait for if nothing was sent.
+ */
+long
+ssl_sendfile(ssl_conn_t *cp, int fd, off_t off, size_t len)
 {
-	int	       n, ec;
-	fd_set         rset;
-	struct timeval tv;
+#ifdef SSL_OP_ENABLE_KTLS
+	return ((long)SSL_sendfile(cp->handle, fd, off, len, 0));
+#else
+	(void)cp; (void)fd; (void)off; (void)len;
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ * Limits the number of bytes ssl_read() and ssl_readln() return to 'len'
+ * bytes, counted from the current read position. A negative 'len' removes
+ * the limit.
+ */
+void
+ssl_set_limit(ssl_conn_t *cp, long len)
+{
+	long buffered;
+
+	if (len < 0) {
+		cp->limit = -1; return;
+	}
+	buffered  = cp->rd - cp->slen;
+	cp->limit = len > buffered ? len - buffered : 0;
+}
+
+/*
+ * Reads and discards the rest of the current message, but not more than
+ * 'max' bytes.
+ *
+ * Returns 0 if the end of the message was reached, and -1 otherwise.
+ */
+int
+ssl_drain(ssl_conn_t *cp, long max)
+{
+	int  n;
+	char buf[4096];
+
+	if (cp->limit > max || (cp->limit < 0 && cp->filter == NULL))
+		return (-1);
+	cp->slen = cp->rd = 0;
+	while (cp->limit != 0) {
+		n = ssl_read(cp, SSL_IO_TIMEOUT, buf, sizeof(buf));
+		if (n < 0 || (n == 0 && cp->limit != 0))
+			return (-1);
+		if ((max -= n) < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Reads up to 'size' bytes of the current message from the connection,
+ * bypassing the input filter.
+ */
+int
+ssl_recv(ssl_conn_t *cp, int waitsecs, void *buf, int size)
+{
+	int n, ec;
 	
+	if (cp->limit == 0)
+		return (0);
+	if (cp->limit > 0 && size > cp->limit)
+		size = (int)cp->limit;
 	if (SSL_pending(cp->handle) > 0) {
 		while ((n = SSL_read(cp->handle, buf, size)) == -1) {
 			if (errno != EINTR) {
 				ERR_print_errors_fp(stderr);
+				ssl_error = SSL_ERR_IO;
 				return (-1);
 			}
 		}
+		if (n > 0 && cp->limit > 0)
+			cp->limit -= n;
 		return (n);
 	}
 	for (n = -1; n < 0;) {
-		tv.tv_sec = waitsecs; tv.tv_usec = 0;
-		FD_ZERO(&rset); FD_SET(cp->sock, &rset);
-		while (select(cp->sock + 1, &rset, NULL, NULL, &tv) == -1) {
-			if (errno != EINTR) {
-				warn("ssl_read(): select()");
-				return (-1);
-			}
+		if ((n = ssl_wait(cp, POLLIN, waitsecs * 1000L)) <= 0) {
+			if (n == 0 && ssl_error == SSL_ERR_TIMEOUT)
+				warnx("ssl_read(): Timeout");
+			return (n == 0 ? TIMEOUT : -1);
 		}
-		if (!FD_ISSET(cp->sock, &rset)) {
-			warnx("ssl_read(): Timeout");
-			return (TIMEOUT);
-		} 
 		if ((n = SSL_read(cp->handle, buf, size)) < 0) {
 			switch ((ec = SSL_get_error(cp->handle, n))) {
 			case SSL_ERROR_WANT_READ:
@@ -176,34 +1047,56 @@ ssl_read(ssl_conn_t *cp, int waitsecs, void *buf, int size)
 					      "SSL-error code %d", n, ec);
 				}
 				ERR_print_errors_fp(stderr);
+				ssl_error = SSL_ERR_IO;
 				return (-1);
 			}
 		}
 	}
-	if (n == 0)
+	if (n == 0) {
 		cp->state = SSL_STATE_DISCONNECTED;
+		ssl_error = SSL_ERR_IO;
+	}
+	else if (cp->limit > 0)
+		cp->limit -= n;
 	return (n);
 }
 
+/*
+ * Installs an input filter (e.g. a decoder for chunked or compressed
+ * replies) that produces the data ssl_read() returns. The filter reads
+ * its input by ssl_recv(), and sets cp->limit to 0 when it reached the
+ * end of the message. 'data' is the filter's state, which is released by
+ * 'destroy' when the filter is replaced, or the connection is closed.
+ */
+void
+ssl_set_filter(ssl_conn_t *cp, int (*filter)(ssl_conn_t *, int, void *, int),
+	       void *data, void (*destroy)(void *))
+{
+	if (cp->fdata != NULL && cp->ffree != NULL)
+		cp->ffree(cp->fdata);
+	cp->fdata  = data;
+	cp->ffree  = destroy;
+	cp->filter = filter;
+}
+
+int
+ssl_read(ssl_conn_t *cp, int waitsecs, void *buf, int size)
+{
+	if (cp->filter != NULL)
+		return (cp->filter(cp, waitsecs, buf, size));
+	return (ssl_recv(cp, waitsecs, buf, size));
+}
+
 int
 ssl_write(ssl_conn_t *cp, const void *buf, size_t size)
 {
-	int	       n, ec;
-	fd_set	       wset;
-	struct timeval tv;
+	int n, ec;
 
 	for (n = -1; n < 0;) {
-		tv.tv_sec = 20; tv.tv_usec = 0;
-		FD_ZERO(&wset); FD_SET(cp->sock, &wset);
-		while (select(cp->sock + 1, NULL, &wset, NULL, &tv) == -1) {
-			if (errno != EINTR) {
-				warn("ssl_write(): select()");
-				return (-1);
-			}
-		}
-		if (!FD_ISSET(cp->sock, &wset)) {
-			warnx("ssl_write(): Timeout");
-			return (TIMEOUT);
+		if ((n = ssl_wait(cp, POLLOUT, SSL_IO_TIMEOUT * 1000L)) <= 0) {
+			if (n == 0 && ssl_error == SSL_ERR_TIMEOUT)
+				warnx("ssl_write(): Timeout");
+			return (n == 0 ? TIMEOUT : -1);
 		}
 		if ((n = SSL_write(cp->handle, buf, size)) < 0) {
 			switch ((ec = SSL_get_error(cp->handle, n))) {
@@ -220,62 +1113,118 @@ ssl_write(ssl_conn_t *cp, const void *buf, size_t size)
 					      "SSL-error code %d", n, ec);
 				}
 				ERR_print_errors_fp(stderr);
+				ssl_error = SSL_ERR_IO;
 				return (-1);
 			}
 		}
 	}
-	if (n == 0)
+	if (n == 0) {
 		cp->state = SSL_STATE_DISCONNECTED;
+		ssl_error = SSL_ERR_IO;
+	}
 	return (n);
 }
 
+/*
+ * Writes the 'iovcnt' buffers described by 'iov' as one message. The data
+ * is gathered into record-sized pieces, so a small request leaves in one
+ * TLS record and TCP segment instead of one per buffer. Large buffers are
+ * written without copying, one record per ssl_write(), so that each record
+ * waits for the socket within the deadline.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int
+ssl_writev(ssl_conn_t *cp, const ssl_iov_t *iov, int iovcnt)
+{
+	int	   i;
+	char	   buf[SSL_RECORD_SIZE];
+	size_t	   len, off, n;
+	const char *p;
+
+	for (i = 0, len = 0; i < iovcnt; i++) {
+		for (p = iov[i].base, off = 0; off < iov[i].len; off += n) {
+			n = iov[i].len - off;
+			if (len == 0 && n >= sizeof(buf)) {
+				n = sizeof(buf);
+				if (ssl_write(cp, p + off, n) <= 0)
+					return (-1);
+				continue;
+			}
+			if (n > sizeof(buf) - len)
+				n = sizeof(buf) - len;
+			(void)memcpy(buf + len, p + off, n);
+			if ((len += n) == sizeof(buf)) {
+				if (ssl_write(cp, buf, len) <= 0)
+					return (-1);
+				len = 0;
+			}
+		}
+	}
+	if (len > 0 && ssl_write(cp, buf, len) <= 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Returns the next line read from the connection, without the trailing
+ * newline. The line is a view into the connection's line buffer, and is
+ * only valid until the next call of ssl_readln() or ssl_read().
+ *
+ * cp->lnbuf[cp->slen] to cp->lnbuf[cp->rd - 1] holds the data not yet
+ * returned. Consumed lines are not moved out of the buffer. The unread
+ * rest is moved to the start only if the buffer is full, and the buffer
+ * is doubled if that doesn't make room. So every byte is searched once
+ * and copied at most a few times, no matter how long the lines are.
+ */
 char *
 ssl_readln(ssl_conn_t *cp)
 {
-	int  i, n;
-	char *p;
-	
+	int  n, scan;
+	char *p, *ln, *nl;
+
 	if (cp->lnbuf == NULL) {
-		if ((cp->lnbuf = malloc(_POSIX2_LINE_MAX)) == NULL)
+		if ((cp->lnbuf = malloc(SSL_LNBUF_SIZE)) == NULL)
 			return (NULL);
-		cp->bufsz = _POSIX2_LINE_MAX;
+		cp->bufsz = SSL_LNBUF_SIZE;
 	}
-	n = 0;
-	do {
-		cp->rd += n;
-		if (cp->slen > 0) {
-			for (i = 0; i < cp->rd - cp->slen; i++)
-				cp->lnbuf[i] = cp->lnbuf[i + cp->slen];
+	for (scan = cp->slen;;) {
+		nl = memchr(cp->lnbuf + scan, '\n', cp->rd - scan);
+		if (nl != NULL) {
+			ln	 = cp->lnbuf + cp->slen;
+			cp->slen = nl - cp->lnbuf + 1;
+			if (nl > ln && nl[-1] == '\r')
+				nl[-1] = '\0';
+			*nl = '\0';
+			return (ln);
 		}
-		cp->rd	-= cp->slen;
-		cp->slen = 0;
-		for (i = 0; i < cp->rd && cp->lnbuf[i] != '\n'; i++)
-			;
-		if (i < cp->rd && cp->lnbuf[i] == '\n') {
-			if (i > 0 && cp->lnbuf[i - 1] == '\r')
-				cp->lnbuf[i - 1] = '\0';
-			cp->slen = i + 1;
-			if (cp->slen >= cp->bufsz)
-				cp->slen = cp->rd = 0;
-			cp->lnbuf[i] = '\0';
-			return (cp->lnbuf);
+		scan = cp->rd;
+		if (cp->rd + 1 >= cp->bufsz && cp->slen > 0) {
+			(void)memmove(cp->lnbuf, cp->lnbuf + cp->slen,
+			    cp->rd - cp->slen);
+			cp->rd	-= cp->slen;
+			scan	-= cp->slen;
+			cp->slen = 0;
 		}
-		if (cp->rd >= cp->bufsz) {
-			p = realloc(cp->lnbuf, cp->bufsz + _POSIX2_LINE_MAX);
-			if (p == NULL)
+		if (cp->rd + 1 >= cp->bufsz) {
+			if ((p = realloc(cp->lnbuf, cp->bufsz * 2)) == NULL)
 				return (NULL);
 			cp->lnbuf  = p;
-			cp->bufsz += _POSIX2_LINE_MAX;
+			cp->bufsz *= 2;
 		}
-	} while ((n = ssl_read(cp, 20, cp->lnbuf + cp->rd,
-	    cp->bufsz - cp->rd)) > 0);
-	if (cp->rd > 0) {
+		n = ssl_read(cp, SSL_IO_TIMEOUT, cp->lnbuf + cp->rd,
+		    cp->bufsz - cp->rd - 1);
+		if (n <= 0)
+			break;
+		cp->rd += n;
+	}
+	ln = NULL;
+	if (cp->rd > cp->slen) {
+		/* Last line without newline. */
+		ln = cp->lnbuf + cp->slen;
 		cp->lnbuf[cp->rd] = '\0';
-		cp->slen = cp->rd = 0;
-		return (cp->lnbuf);
 	}
 	cp->slen = cp->rd = 0;
 
-	return (NULL);
+	return (ln);
 }
-
@@ -25,32 +25,101 @@
 #ifndef _SSL_H_
 # define _SSL_H_ 1
 #include <sys/types.h>
+#include <poll.h>
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "types.h"
+
 #define TIMEOUT	 0
 #define SSL_PORT 443
 
+#define SSL_OPT_DEFAULT 0	/* Options for ssl_connect(). */
+#define SSL_OPT_KTLS	1	/* Try to enable kernel TLS. */
+#define SSL_OPT_H2	2	/* Offer HTTP/2 by ALPN. */
+#define SSL_ALPN_H2	"\002h2\010http/1.1"
+#define PATH_SESSIONS	".cliaspora.sessions"
+
+/*
+ * Classes of failures, stored in ssl_error.
+ */
+#define SSL_ERR_NONE	0
+#define SSL_ERR_CONNECT	1	/* No TCP connection */
+#define SSL_ERR_TLS	2	/* TLS handshake failed */
+#define SSL_ERR_TIMEOUT	3
+#define SSL_ERR_IO	4	/* Connection broke or was closed */
+#define SSL_ERR_DEADLINE 5	/* Deadline of the command exceeded */
+
+#define SSL_CONNECT_TIMEOUT 30	/* Default connect deadline in seconds. */
+#define SSL_ATTEMPT_DELAY   250	/* ms between two connection attempts. */
+#define SSL_IO_TIMEOUT	    20	/* Max. seconds to wait for I/O. */
+#define SSL_RECORD_SIZE	    16384	/* Max. TLS record payload. */
+#define SSL_LNBUF_SIZE	    8192	/* Initial size of the line buffer. */
+
+typedef struct ssl_iov_s {
+	const void *base;
+	size_t	   len;
+} ssl_iov_t;
+
 typedef struct ssl_conn_s {
 	int	bufsz;
 	int	rd;
 	int	slen;
 	int	sock;
 	int	state;
+#define SSL_STATE_CONNECTING   3
+#define SSL_STATE_HANDSHAKE    2
 #define SSL_STATE_CONNECTED    1
 #define SSL_STATE_DISCONNECTED 0
+	int	nreq;		/* Number of requests sent. */
+	int	keepalive;	/* Server allows to reuse the connection. */
+	long	limit;		/* Bytes left in current message, or -1. */
+	u_short	port;
 	char	*host;
 	char	*lnbuf;
+	void	*reply;		/* Parsed header of the last reply. */
+	void	(*rfree)(void *);
+	void	*fdata;		/* State of the input filter. */
+	void	(*ffree)(void *);
+	int	(*filter)(struct ssl_conn_s *, int, void *, int);
 	SSL	*handle;
 	SSL_CTX *ctx;
+	struct tcp_attempts_s *attempts; /* While SSL_STATE_CONNECTING */
 } ssl_conn_t;
 
+extern int	   ssl_connect_timeout;
+extern int	   ssl_error;
+extern bool	   ssl_ktls;
 extern int	   ssl_read(ssl_conn_t *, int, void *, int); //size_t);
+extern int	   ssl_recv(ssl_conn_t *, int, void *, int);
 extern int	   ssl_write(ssl_conn_t *, const void *, size_t);
+extern int	   ssl_writev(ssl_conn_t *, const ssl_iov_t *, int);
+extern int	   ssl_reconnect(ssl_conn_t *);
+extern int	   ssl_drain(ssl_conn_t *, long);
+extern int	   ssl_connecting(ssl_conn_t *);
+extern int	   ssl_connect_fds(const ssl_conn_t *, struct pollfd *);
+extern int	   ssl_connect_wait(const ssl_conn_t *);
+extern int	   ssl_handshake(ssl_conn_t *);
+extern int	   ssl_events(ssl_conn_t *, int);
+extern int	   ssl_set_nonblock(ssl_conn_t *, bool);
+extern bool	   ssl_alive(ssl_conn_t *);
+extern bool	   ssl_ktls_send(ssl_conn_t *);
+extern bool	   ssl_alpn_is(ssl_conn_t *, const char *);
+extern bool	   ssl_expired(void);
+extern int	   ssl_time_left(int);
+extern void	   ssl_set_deadline(int);
+extern long	   ssl_sendfile(ssl_conn_t *, int, off_t, size_t);
+extern void	   ssl_set_limit(ssl_conn_t *, long);
+extern void	   ssl_set_filter(ssl_conn_t *, int (*)(ssl_conn_t *, int, void *,
+				  int), void *, void (*)(void *));
 extern char	  *ssl_readln(ssl_conn_t *);
 extern void	   ssl_disconnect(ssl_conn_t *);
+extern ssl_conn_t *ssl_new(const char *, u_short);
+extern ssl_conn_t *ssl_open(const char *, u_short);
+extern ssl_conn_t *ssl_open_opts(const char *, u_short, int);
 extern ssl_conn_t *ssl_connect(const char *, u_short);
+extern ssl_conn_t *ssl_connect_opts(const char *, u_short, int);
 
 #endif /* !_SSL_H_ */
 